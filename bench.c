@@ -0,0 +1,306 @@
+/*
+ * Decoder microbenchmarks for fbvnc
+ *
+ * Each benchmark generates a synthetic payload with known statistics,
+ * decodes it repeatedly into rfb and reports the cost per pixel.  The
+ * framebuffer is taken from FBDEV; it defaults to a 1920x1080 memory
+ * framebuffer.
+ */
+#define main fbvnc_main
+#include "fbvnc.c"
+#undef main
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()	__rdtsc()
+#else
+#define CYCLES()	0
+#endif
+
+#define BENCHTIME	200000		/* minimum duration of each benchmark (us) */
+
+static struct scratch pay;	/* the synthetic payload */
+static long paylen;
+static struct scratch zdat;	/* compressed payload */
+static long zdatlen;
+static unsigned rnd_seed = 1;
+
+static unsigned rnd(void)
+{
+	rnd_seed = rnd_seed * 1103515245 + 12345;
+	return rnd_seed >> 8;
+}
+
+static void put(void *buf, long len)
+{
+	scratch(&pay, paylen + len);
+	memcpy(pay.buf + paylen, buf, len);
+	paylen += len;
+}
+
+static void putc8(int c)
+{
+	u8 b = c;
+	put(&b, 1);
+}
+
+static void putpix(int n)
+{
+	while (n-- > 0)
+		putc8(rnd());
+}
+
+/* a ZRLE run length */
+static void putrun(int n)
+{
+	for (n--; n >= 255; n -= 255)
+		putc8(255);
+	putc8(n);
+}
+
+static int gen_ts = 64;		/* generated tile size */
+
+/* ZRLE tiles covering the screen; subenc selects the tile type */
+static void zrle_gen(int subenc, int run)
+{
+	int cpp = bpp == 4 ? 3 : bpp;
+	int x, y, i, k;
+	paylen = 0;
+	for (y = 0; y < srv_rows; y += gen_ts) {
+		for (x = 0; x < srv_cols; x += gen_ts) {
+			int tw = MIN(gen_ts, srv_cols - x);
+			int th = MIN(gen_ts, srv_rows - y);
+			int bits = subenc > 4 ? 4 : (subenc > 2 ? 2 : 1);
+			putc8(subenc);
+			if (subenc == 0)
+				putpix(tw * th * cpp);
+			if (subenc == 1)
+				putpix(cpp);
+			if (subenc >= 2 && subenc <= 16) {
+				putpix(subenc * cpp);
+				for (i = 0; i < th; i++)
+					putpix((tw * bits + 7) / 8);
+			}
+			if (subenc >= 128) {
+				putpix((subenc - 128) * cpp);
+				for (k = 0; k < tw * th; k += run) {
+					if (subenc == 128)
+						putpix(cpp);
+					else
+						putc8((rnd() % (subenc - 128)) | (run > 1 ? 0x80 : 0));
+					if (subenc == 128 || run > 1)
+						putrun(MIN(run, tw * th - k));
+				}
+			}
+		}
+	}
+}
+
+static void zrle_run(void)
+{
+	memcpy(z_out.buf, pay.buf, paylen);
+	z_outlen = paylen;
+	z_outpos = 0;
+	rect_pos = 0;
+	readzrle(0, 0, srv_cols, srv_rows, 64);
+}
+
+static void trle_run(void)
+{
+	memcpy(ibuf.buf, pay.buf, paylen);
+	ilen = paylen;
+	ipos = 0;
+	rect_pos = 0;
+	rect_x = 0;
+	rect_y = 0;
+	rect_w = srv_cols;
+	rect_h = srv_rows;
+	readtrle();
+}
+
+static void inflate_run(void)
+{
+	inflateReset(&z_str);
+	z_outlen = 0;
+	z_outpos = 0;
+	z_push(zdat.buf, zdatlen);
+}
+
+/* compress the payload for inflate_run() */
+static void zlib_gen(void)
+{
+	uLongf len = compressBound(paylen);
+	scratch(&zdat, len);
+	compress2((void *) zdat.buf, &len, (void *) pay.buf, paylen, 6);
+	zdatlen = len;
+}
+
+static int fill_size;
+
+static void fill_run(void)
+{
+	char pixel[8] = {0};
+	int x, y;
+	for (y = 0; y + fill_size <= srv_rows; y += fill_size)
+		for (x = 0; x + fill_size <= srv_cols; x += fill_size)
+			dec->fillrect(pixel, x, y, fill_size, fill_size);
+}
+
+/* an RRE rect with n subrects of the given size */
+static void rre_gen(int n, int size)
+{
+	u32 cnt = htonl(n);
+	u16 pos[4];
+	int i;
+	paylen = 0;
+	put(&cnt, 4);
+	putpix(bpp);
+	for (i = 0; i < n; i++) {
+		putpix(bpp);
+		pos[0] = htons(rnd() % (srv_cols - size));
+		pos[1] = htons(rnd() % (srv_rows - size));
+		pos[2] = htons(size);
+		pos[3] = htons(size);
+		put(pos, 8);
+	}
+}
+
+static void rre_run(void)
+{
+	memcpy(ibuf.buf, pay.buf, paylen);
+	ilen = paylen;
+	ipos = 0;
+	rect_x = 0;
+	rect_y = 0;
+	rect_w = srv_cols;
+	rect_h = srv_rows;
+	readrre();
+}
+
+static void zrows_run(void)
+{
+	memcpy(z_out.buf, pay.buf, paylen);
+	z_outlen = paylen;
+	z_outpos = 0;
+	rect_pos = 0;
+	rect_left = 0;
+	rect_enc = VNC_ENC_ZLIB;
+	rect_x = 0;
+	rect_y = 0;
+	rect_w = srv_cols;
+	rect_h = srv_rows;
+	readzlib();
+}
+
+static void blit_run(void)
+{
+	drawfb(0, 0, srv_cols, srv_rows);
+}
+
+/* the framebuffer copy before non-temporal stores and blitter threads */
+static void memcpy_run(void)
+{
+	int i;
+	for (i = 0; i < srv_rows; i++)
+		memcpy(fb_mem(i), RFB(0, i), (long) srv_cols * bpp);
+}
+
+/* run fn repeatedly; pixels is the number of pixels it writes */
+static void bench(char *name, void (*fn)(void), long pixels)
+{
+	long beg = now();
+	long n = 0;
+	long t;
+	unsigned long long c = CYCLES();
+	do {
+		fn();
+		n++;
+	} while ((t = now() - beg) < BENCHTIME);
+	c = CYCLES() - c;
+	printf("%-28s %10.2f cycles/px %8.3f ns/px %8.2f GB/s\n", name,
+		(double) c / n / pixels, t * 1000.0 / n / pixels,
+		(double) n * pixels * bpp / t / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	char memfb[] = "-:1920x1080";
+	long px;
+	char name[64];
+	int runs[] = {1, 4, 16, 64};
+	int i, n;
+	if (fb_init(getenv("FBDEV") ? getenv("FBDEV") : memfb)) {
+		fprintf(stderr, "bench: fb_init failed\n");
+		return 1;
+	}
+	srv_cols = fb_cols();
+	srv_rows = fb_rows();
+	cols = srv_cols;
+	rows = srv_rows;
+	bpp = FBM_BPP(fb_mode());
+	fbpp = bpp;
+	dec = &decoders[MAX(1, MIN(4, bpp)) - 1];
+	px = (long) srv_cols * srv_rows;
+	if (rfb_init() || z_init())
+		return 1;
+	scratch(&z_out, (long) srv_cols * srv_rows * bpp * 2);
+	scratch(&ibuf, (long) srv_cols * srv_rows * bpp);
+	printf("%dx%d, %d bytes per pixel\n", srv_cols, srv_rows, bpp);
+
+	zrle_gen(0, 0);
+	bench("zrle raw", zrle_run, px);
+	zrle_gen(1, 0);
+	bench("zrle solid", zrle_run, px);
+	for (i = 2; i <= 16; i *= 2) {
+		zrle_gen(i, 0);
+		sprintf(name, "zrle packed palette/%d", i);
+		bench(name, zrle_run, px);
+	}
+	for (i = 0; i < LEN(runs); i++) {
+		zrle_gen(128, runs[i]);
+		sprintf(name, "zrle plain rle/run %d", runs[i]);
+		bench(name, zrle_run, px);
+	}
+	for (i = 0; i < LEN(runs); i++) {
+		zrle_gen(128 + 16, runs[i]);
+		sprintf(name, "zrle palette rle/run %d", runs[i]);
+		bench(name, zrle_run, px);
+	}
+	zrle_gen(128 + 16, 4);
+	zlib_gen();
+	bench("inflate (palette rle/run 4)", inflate_run, px);
+	gen_ts = 16;
+	zrle_gen(128 + 16, 4);
+	bench("trle palette rle/run 4", trle_run, px);
+	zrle_gen(0, 0);
+	bench("trle raw", trle_run, px);
+	gen_ts = 64;
+	for (fill_size = 4; fill_size <= 64; fill_size *= 4) {
+		sprintf(name, "fillrect %dx%d", fill_size, fill_size);
+		bench(name, fill_run, px / fill_size / fill_size * fill_size * fill_size);
+	}
+	rre_gen(10000, 8);
+	bench("rre 10000 8x8 subrects", rre_run, px + 10000 * 64);
+	paylen = 0;
+	putpix(px * bpp);
+	bench("zlib rows", zrows_run, px);
+	bench("blit memcpy", memcpy_run, px);
+	blit_init(BLITMAX);
+	for (i = 0, n = blit_n; i < 2; i++) {
+		blit_n = i ? n : 1;
+		for (rotate = 0; rotate < 4; rotate++) {
+			vnc_view();
+			if (rotate)
+				sprintf(name, "drawfb %d deg/%d threads", rotate * 90, blit_n);
+			else
+				sprintf(name, "drawfb/%d threads", blit_n);
+			bench(name, blit_run, (long) cols * rows);
+		}
+	}
+	rotate = 0;
+	vnc_view();
+
+	z_free();
+	rfb_free();
+	fb_free();
+	return 0;
+}
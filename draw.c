@@ -66,6 +66,21 @@ void fb_cmap(void)
 	ioctl(fd, FBIOPUTCMAP, &cmap);
 }
 
+/* set n colour map entries of a pseudocolour framebuffer from start */
+int fb_setcmap(int start, int n, unsigned short *r, unsigned short *g, unsigned short *b)
+{
+	struct fb_cmap cmap;
+	if (finfo.visual != FB_VISUAL_PSEUDOCOLOR)
+		return -1;
+	cmap.start = start;
+	cmap.len = n;
+	cmap.red = r;
+	cmap.green = g;
+	cmap.blue = b;
+	cmap.transp = NULL;
+	return ioctl(fd, FBIOPUTCMAP, &cmap);
+}
+
 unsigned fb_mode(void)
 {
 	return ((rl < gl) << 22) | ((rl < bl) << 21) | ((gl < bl) << 20) |
@@ -86,6 +101,33 @@ static void init_colors(void)
 	bl = vinfo.blue.offset;
 }
 
+/* a 32-bit framebuffer in memory, for testing and benchmarks */
+static int fb_initmem(void)
+{
+	vinfo.xres = xres ? xres : 1024;
+	vinfo.yres = yres ? yres : 768;
+	vinfo.yres_virtual = vinfo.yres;
+	vinfo.bits_per_pixel = 32;
+	vinfo.red.offset = 16;
+	vinfo.red.length = 8;
+	vinfo.green.offset = 8;
+	vinfo.green.length = 8;
+	vinfo.blue.offset = 0;
+	vinfo.blue.length = 8;
+	finfo.visual = FB_VISUAL_TRUECOLOR;
+	finfo.line_length = vinfo.xres * 4;
+	xres = 0;
+	yres = 0;
+	bpp = 4;
+	fd = -1;
+	fb = mmap(NULL, fb_len(), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (fb == MAP_FAILED)
+		return 1;
+	init_colors();
+	return 0;
+}
+
 int fb_init(char *dev)
 {
 	char *path = dev ? dev : FBDEV;
@@ -94,6 +136,8 @@ int fb_init(char *dev)
 		*geom = '\0';
 		sscanf(geom + 1, "%dx%d%d%d", &xres, &yres, &xoff, &yoff);
 	}
+	if (!strcmp(path, "-"))
+		return fb_initmem();
 	fd = open(path, O_RDWR);
 	if (fd < 0)
 		goto failed;
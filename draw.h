@@ -14,4 +14,5 @@ void *fb_mem(int r);
 int fb_rows(void);
 int fb_cols(void);
 void fb_cmap(void);
+int fb_setcmap(int start, int n, unsigned short *r, unsigned short *g, unsigned short *b);
 unsigned fb_val(int r, int g, int b);
@@ -15,6 +15,7 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
@@ -22,20 +23,32 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <linux/input.h>
 #include <zlib.h>
+#ifdef FBVNC_H264
+#include <libavcodec/avcodec.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "draw.h"
 #include "vnc.h"
+#include "shm.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
@@ -43,19 +56,73 @@
 
 #define VNC_PORT	"5900"
 #define SCRSCRL		2
+#define ENC_PERIOD	2000000		/* encoding evaluation period (us) */
+#define ENC_HOLD	3		/* periods before switching encodings */
+#define RECVCHUNK	(64 << 10)	/* minimum free space for recv() */
+#define HUGEPAGE	(2 << 20)	/* scratch buffers backed by huge pages */
+#define CUTCHUNK	(64 << 10)	/* icut bytes written per iteration */
+#define CUTMAX		(16 << 20)	/* maximum accepted unsolicited text */
+#define RBLK		16		/* rotation block size */
+#define BLITMAX		4		/* maximum number of blitter threads */
+#define BLITROWS	32		/* rows per blitter job; a multiple of RBLK */
+#define BLITPAR		(1 << 16)	/* blits of this many pixels are shared among threads */
+#define DMGMAX		256		/* rects shown in the damage overlay */
+#define DMGFADE		2000000		/* damage overlay fading time (us) */
+#define DMGTICK		100000		/* damage overlay redraw interval (us) */
+#define FRMSLOW		20000		/* updates slower than this delay the next request (us) */
+#define FRMSKIP		100000		/* maximum blit interval while behind the server (us) */
+#define SESSMAX		9		/* maximum number of sessions */
+#define BGPERIOD	1000000		/* update interval of background sessions (us) */
+#define H264CTX		4		/* maximum number of H.264 decoders */
+#define SNAPMAGIC	0x50414e53	/* snapshot file magic: "SNAP" */
+#define CMAP_LUT	1		/* colour-mapped pixels are expanded when drawn */
+#define CMAP_FB		2		/* colour-mapped pixels use the framebuffer palette */
+#define TILE		64		/* size of dirty tracking tiles */
+#define TILE_DIRTY	1		/* tile changed since the last blit */
+#define TILE_STALE	2		/* tile contents not received yet */
 
 #define RFB(x, y)	(rfb + ((y) * srv_cols + (x)) * bpp)
+#define INLINE		inline __attribute__((always_inline))
+
+/* pipeline tracing; compiled in with -DFBVNC_TRACE (make TRACE=1) */
+#ifdef FBVNC_TRACE
+#define TRACEMAX	(1 << 16)	/* events kept in the trace ring */
+#define TRACE_NOW()	now()
+#define TRACE(name, beg)	trace(name, beg)
+#else
+#define TRACE_NOW()	0
+#define TRACE(name, beg)	((void) (beg))
+#endif
 
 static int cols, rows;		/* framebuffer dimensions */
 static int bpp;			/* bytes per pixel */
+static int fbpp;		/* bytes per framebuffer pixel */
 static int srv_cols, srv_rows;	/* server screen dimensions */
 static int or, oc;		/* visible screen offset */
+static int rotate;		/* clockwise framebuffer rotation (quarter turns) */
 static int mr, mc;		/* mouse position */
 static int nodraw;		/* do not draw anything */
 static int nodraw_ref;		/* pending screen redraw */
+static long hid_period;		/* update interval when not drawing; 0 to pause (us) */
 static long vnc_nr;		/* number of bytes received */
 static long vnc_nw;		/* number of bytes sent */
+static long vnc_wait;		/* microseconds spent waiting for the server */
+static long vnc_nc;		/* number of bytes parsed */
 static char *rfb;		/* remote framebuffer contents */
+static long rfb_len;		/* size of rfb mapping */
+static char *tiles;		/* TILE_* flags of rfb tiles */
+static int tcols, trows;	/* tile grid dimensions */
+static int req_x, req_y, req_w, req_h;	/* pending non-incremental request */
+static int dsk_fit;		/* ask the server to match the framebuffer size */
+static int dsk_sent;		/* SetDesktopSize has been sent */
+static long *tile_nr;		/* bytes received for each tile */
+static char *shm_path;		/* file to share rfb in */
+static struct shm_head *shm;	/* the header of the shared rfb */
+static char *snap_dir;		/* directory of screen snapshots */
+static char *snap_path;		/* the snapshot file of this server */
+static int cmap_mode;		/* colour-mapped pixels: 0, CMAP_LUT or CMAP_FB */
+static unsigned cmap_rgb[256];	/* colour map entries as 0xrrggbb */
+static unsigned cmap_lut[256];	/* framebuffer pixels of colour map entries */
 static char *icut;		/* incoming cut text file */
 static char *ocut;		/* outgoing cut text file */
 
@@ -64,34 +131,306 @@ static int lock_code[4] = {0xffe9, 0xffe3, 0xffe1, 0xffeb};
 static int lock_active[4];	/* modifier lock is active */
 static int lock_key[4];		/* key assigned to the modifier */
 
+/* adaptive encoding selection */
+static struct encstat {
+	int enc;		/* encoding */
+	char *name;		/* encoding name */
+	double bpx;		/* received bytes per pixel */
+	double dpx;		/* decoding microseconds per pixel */
+	long nr, px, dec;	/* bytes, pixels, and decoding time in this period */
+	long nz;		/* inflated bytes in this period */
+} enc_stat[] = {
+	{VNC_ENC_RAW, "raw", 4, 0.001},
+	{VNC_ENC_RRE, "rre", 1, 0.01},
+	{VNC_ENC_ZLIB, "zlib", 1, 0.02},
+	{VNC_ENC_TRLE, "trle", 1, 0.01},
+	{VNC_ENC_ZRLE, "zrle", 0.5, 0.02},
+#ifdef FBVNC_H264
+	{VNC_ENC_H264, "h264", 0.05, 0.02},
+#endif
+};
+static int enc_auto;		/* adapt the encoding to the link */
+static int enc_cur;		/* preferred encoding */
+static int enc_lev = -1;	/* compression level; -1 for server default */
+static int enc_next, enc_nlev;	/* candidate encoding and level */
+static int enc_hold;		/* periods the candidate has been chosen */
+static long enc_beg;		/* current period's start time */
+static long enc_nr, enc_wait;	/* vnc_nr and vnc_wait at enc_beg */
+static double enc_rate;		/* estimated link rate (bytes per us) */
+
+/* buffers reused across messages; they only grow to their high-water mark */
+struct scratch {
+	char *buf;
+	long size;
+};
+static long vnc_nalloc;		/* number of scratch buffer allocations */
+static struct scratch msg_buf;	/* variable-length message contents */
+static struct scratch ibuf;	/* received data not parsed yet */
+static long ilen, ipos;		/* ibuf length and parsing position */
+static long ineed;		/* bytes the parser is waiting for */
+static struct scratch wq;	/* outgoing data waiting for the socket */
+static long wq_len, wq_pos;	/* queued bytes and bytes already sent */
+
+/* blitter threads */
+struct blit {
+	int c, r, w, h;		/* the rfb rect to draw */
+};
+static struct scratch blit_job;	/* queued blits */
+static int blit_cnt;		/* number of queued blits */
+static long blit_px;		/* pixels in queued blits */
+static int blit_next;		/* the next blit to draw */
+static int blit_n = 1;		/* number of threads drawing blits */
+static pthread_mutex_t blit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blit_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t blit_done = PTHREAD_COND_INITIALIZER;
+static long blit_gen;		/* incremented for each shared flush */
+static int blit_left;		/* threads still drawing */
+
+/* extended clipboard */
+static int clip_caps;		/* server's extended clipboard flags */
+static long clip_tmax;		/* server's maximum text size; 0 if not given */
+static long cut_skip;		/* bytes of an oversized cut text to discard */
+static struct scratch clip_buf;	/* outgoing clipboard text */
+static long clip_len;
+static long clip_tlen;		/* clip_buf length with CRLF line breaks and a nul */
+static struct scratch clip_zbuf;	/* compressed clipboard data */
+static struct scratch clip_out;	/* compressed outgoing text */
+static long clip_outlen;
+static int clip_ready;		/* clip_out is complete */
+static int clip_want;		/* the server asked for the text before it was ready */
+static int ocut_fd = -1;	/* ocut file being read */
+static long ocut_max;		/* maximum outgoing text size */
+static z_stream ocut_z;		/* compressing clip_buf into clip_out */
+static long ocut_pos;		/* clip_buf bytes compressed */
+static int ocut_zon;		/* ocut_z is compressing */
+static struct scratch icut_buf;	/* incoming cut text being written */
+static long icut_len, icut_pos;
+static int icut_fd = -1;
+
 static z_stream z_str;
-static char *z_out;
+static struct scratch z_out;	/* inflated rect data */
 static int z_outlen;
-static int z_outsize;
 static int z_outpos;
+static int z_short;		/* z_read() ran out of data */
+static long z_nout;		/* number of bytes inflated */
+
+/* the message being parsed */
+static int upd_rects;		/* rects remaining in the current update */
+static long upd_beg;		/* the time the update started */
+static long upd_busy;		/* time spent decoding and drawing it */
+static long evt_beg;		/* the time vnc_event() was called */
+static int upd_done;		/* updates completed in this vnc_event() */
+static long upd_dec;		/* the last update's decoding time */
+
+/* damage overlay */
+static int dmg_on;		/* outline decoded rects on the screen */
+static char *dmg_out;		/* file to save tile_nr in */
+static struct dmg {
+	int x, y, w, h;		/* rect position */
+	int enc;		/* rect encoding */
+	long t;			/* the time it was decoded */
+} dmg[DMGMAX];
+static int dmg_n;
+static int dmg_new;		/* rects were added since the last redraw */
+static long dmg_last;		/* the time the overlay was drawn */
+
+/* backpressure */
+static long frm_blit;		/* the last blit's duration */
+static long frm_last;		/* the time of the last blit */
+static long frm_next;		/* do not request updates before this time */
+static long frm_skip;		/* the time the first blit was skipped */
+static long frm_drop;		/* number of updates not drawn separately */
+static long frm_behind;		/* microseconds spent with skipped blits */
+
+static int rect_busy;		/* the rect header has been read */
+static long rect_nc;		/* vnc_nc at the start of the rect */
+static int rect_x, rect_y, rect_w, rect_h, rect_enc;
+static long rect_pos;		/* raw bytes, zlib rows or zrle tiles decoded */
+static long rect_left;		/* compressed bytes not received yet */
+static char trle_pal[128 * 4];	/* the last palette; TRLE tiles may reuse it */
+static int trle_npal;		/* trle_pal entries */
+
+#ifdef FBVNC_TRACE
+static struct trace {
+	char *name;		/* pipeline stage */
+	long beg, dur;		/* start time and duration (us) */
+} trace_ring[TRACEMAX];
+static long trace_n;		/* number of events recorded */
+static char *trace_out;		/* trace output file */
+#endif
+static int req_pending;		/* an update request is outstanding */
+
+#ifdef FBVNC_H264
+/* open h.264 decoders; each belongs to a rect */
+static struct h264 {
+	int x, y, w, h;
+	AVCodecContext *ctx;
+} h264_ctx[H264CTX];
+static int h264_old;		/* the decoder to replace next */
+static const AVCodec *h264_codec;
+static AVPacket *h264_pkt;
+static AVFrame *h264_frm;
+static struct scratch h264_buf;	/* padded H.264 data */
+#define SESS_H264	X(h264_ctx) X(h264_old)
+#else
+#define SESS_H264
+#endif
+
+/* per-session state, swapped in and out of the variables above */
+#define SESS_VARS \
+	X(srv_cols) X(srv_rows) X(cols) X(rows) X(or) X(oc) X(mr) X(mc) \
+	X(vnc_nr) X(vnc_nw) X(vnc_wait) X(vnc_nc) \
+	X(rfb) X(rfb_len) X(tiles) X(tcols) X(trows) X(tile_nr) X(shm_path) X(shm) X(snap_path) \
+	X(req_x) X(req_y) X(req_w) X(req_h) X(req_pending) X(dsk_sent) X(cmap_rgb) X(cmap_lut) \
+	X(enc_stat) X(enc_auto) X(enc_cur) X(enc_lev) X(enc_next) X(enc_nlev) \
+	X(enc_hold) X(enc_beg) X(enc_nr) X(enc_wait) X(enc_rate) \
+	X(msg_buf) X(ibuf) X(ilen) X(ipos) X(ineed) X(wq) X(wq_len) X(wq_pos) \
+	X(clip_caps) X(clip_tmax) X(cut_skip) X(z_str) X(z_out) X(z_outlen) X(z_outpos) X(z_short) \
+	X(upd_rects) X(upd_beg) X(upd_busy) X(upd_dec) \
+	X(frm_blit) X(frm_last) X(frm_next) X(frm_skip) X(frm_drop) X(frm_behind) \
+	X(rect_busy) X(rect_nc) X(rect_x) X(rect_y) X(rect_w) X(rect_h) \
+	X(rect_enc) X(rect_pos) X(rect_left) X(trle_pal) X(trle_npal) SESS_H264
+
+static struct sess {
+	int fd;			/* server connection */
+#define X(v)	__typeof__(v) v;
+	SESS_VARS
+#undef X
+} sess[SESSMAX];
+static struct sess sess_new;	/* the initial state of sessions */
+static int sess_n;		/* number of sessions */
+static int sess_cur;		/* the visible session */
+static int sess_bg;		/* a background session is loaded */
+static int sess_req = -1;	/* session requested from the keyboard */
+
+static long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000l + ts.tv_nsec / 1000;
+}
+
+#ifdef FBVNC_TRACE
+/* record a pipeline stage that started at beg */
+static void trace(char *name, long beg)
+{
+	struct trace *t = &trace_ring[trace_n++ % TRACEMAX];
+	t->name = name;
+	t->beg = beg;
+	t->dur = now() - beg;
+}
+
+/* write the trace ring in Chrome's trace event format */
+static void trace_save(char *path)
+{
+	FILE *fp = fopen(path, "w");
+	long i;
+	if (!fp)
+		return;
+	fprintf(fp, "{\"traceEvents\": [\n");
+	for (i = MAX(0, trace_n - TRACEMAX); i < trace_n; i++) {
+		struct trace *t = &trace_ring[i % TRACEMAX];
+		fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %ld, "
+			"\"dur\": %ld, \"pid\": 1, \"tid\": 1}%s\n",
+			t->name, t->beg, t->dur, i + 1 < trace_n ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	fclose(fp);
+}
+#endif
+
+static void scratch_free(struct scratch *sc)
+{
+	if (sc->size >= HUGEPAGE)
+		munmap(sc->buf, sc->size);
+	else
+		free(sc->buf);
+	sc->buf = NULL;
+	sc->size = 0;
+}
+
+/* make sc at least len bytes long, preserving its contents */
+static void *scratch(struct scratch *sc, long len)
+{
+	char *buf;
+	long size;
+	if (len <= sc->size && sc->buf)
+		return sc->buf;
+	size = MAX(len, MAX(4096, sc->size * 2));
+	if (size >= HUGEPAGE) {
+		size = (size + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED)
+			return NULL;
+		madvise(buf, size, MADV_HUGEPAGE);
+	} else if ((buf = malloc(size)) == NULL) {
+		return NULL;
+	}
+	if (sc->size)
+		memcpy(buf, sc->buf, sc->size);
+	scratch_free(sc);
+	sc->buf = buf;
+	sc->size = size;
+	vnc_nalloc++;
+	return buf;
+}
 
 static int vread(int fd, void *buf, long len)
 {
+	long beg = now();
 	long nr = 0;
 	long n;
 	while (nr < len && (n = read(fd, buf + nr, len - nr)) > 0)
 		nr += n;
 	vnc_nr += nr;
+	vnc_wait += now() - beg;
+	TRACE("vread", beg);
 	if (nr < len)
 		fprintf(stderr, "fbvnc: partial vnc read!\n");
 	return nr < len ? -1 : len;
 }
 
+/* send queued data without blocking */
+static int vflush(int fd)
+{
+	long n;
+	while (wq_pos < wq_len) {
+		n = send(fd, wq.buf + wq_pos, wq_len - wq_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		wq_pos += n;
+	}
+	wq_len = 0;
+	wq_pos = 0;
+	return 0;
+}
+
+/* write what the socket accepts and queue the rest */
 static int vwrite(int fd, void *buf, long len)
 {
 	long nw = 0;
-	long n;
-	while (nw < len && (n = write(fd, buf, len)) > 0)
+	long n = 0;
+	while (!wq_len && nw < len &&
+			(n = send(fd, buf + nw, len - nw, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
 		nw += n;
-	if (nw != len)
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
 		fprintf(stderr, "fbvnc: partial vnc write!\n");
+		return -1;
+	}
+	if (nw < len) {
+		if (wq_pos) {
+			memmove(wq.buf, wq.buf + wq_pos, wq_len - wq_pos);
+			wq_len -= wq_pos;
+			wq_pos = 0;
+		}
+		if (!scratch(&wq, wq_len + len - nw))
+			return -1;
+		memcpy(wq.buf + wq_len, buf + nw, len - nw);
+		wq_len += len - nw;
+	}
 	vnc_nw += len;
-	return nw < len ? -1 : nw;
+	return len;
 }
 
 static int z_init(void)
@@ -104,40 +443,38 @@ static int z_init(void)
 	return inflateInit(&z_str) != Z_OK;
 }
 
+/* inflate src directly into z_out, after its unread data */
 static int z_push(void *src, int len)
 {
-	char buf[512];
-	z_outlen = 0;
-	z_outpos = 0;
+	int ret;
+	if (z_outpos) {
+		memmove(z_out.buf, z_out.buf + z_outpos, z_outlen - z_outpos);
+		z_outlen -= z_outpos;
+		z_outpos = 0;
+	}
 	z_str.next_in = src;
 	z_str.avail_in = len;
-	while (z_str.avail_in > 0) {
-		int nr;
-		z_str.avail_out = sizeof(buf);
-		z_str.next_out = (void *) buf;
-		if (inflate(&z_str, Z_NO_FLUSH) != Z_OK)
+	do {
+		if (z_out.size - z_outlen < 4096 && !scratch(&z_out, z_outlen + 4096))
 			return 1;
-		nr = sizeof(buf) - z_str.avail_out;
-		if (z_outlen + nr > z_outsize) {
-			char *old = z_out;
-			while (z_outlen + nr > z_outsize)
-				z_outsize = MAX(z_outsize, 4096) * 2;
-			z_out = malloc(z_outsize);
-			if (z_outlen)
-				memcpy(z_out, old, z_outlen);
-			free(old);
-		}
-		memcpy(z_out + z_outlen, buf, nr);
-		z_outlen += nr;
-	}
+		z_str.next_out = (void *) z_out.buf + z_outlen;
+		z_str.avail_out = z_out.size - z_outlen;
+		ret = inflate(&z_str, Z_SYNC_FLUSH);
+		z_nout += (char *) z_str.next_out - z_out.buf - z_outlen;
+		z_outlen = (char *) z_str.next_out - z_out.buf;
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return 1;
+	} while (z_str.avail_in > 0 || z_str.avail_out == 0);
 	return 0;
 }
 
 static int z_read(void *dst, int len)
 {
-	if (z_outpos + len > z_outlen)
+	if (z_outpos + len > z_outlen) {
+		z_short = 1;
 		return 1;
-	memcpy(dst, z_out + z_outpos, len);
+	}
+	memcpy(dst, z_out.buf + z_outpos, len);
 	z_outpos += len;
 	return 0;
 }
@@ -149,373 +486,1903 @@ static int z_char(void)
 	return c;
 }
 
-static int z_free(void)
+static int z_free(void)
+{
+	inflateEnd(&z_str);
+	scratch_free(&z_out);
+	scratch_free(&ibuf);
+	scratch_free(&msg_buf);
+	scratch_free(&wq);
+	scratch_free(&clip_buf);
+	scratch_free(&clip_zbuf);
+	scratch_free(&clip_out);
+	scratch_free(&icut_buf);
+	return 0;
+}
+
+/*
+ * The decoders below are instantiated for each pixel size: bpp and cpp
+ * are constants in their callers, so that pixel copies become single
+ * moves.  dec points to the instances for the current pixel format.
+ */
+static INLINE void fill_n(char *pixel, char *dst, int w, int h, long stride, int bpp)
+{
+	int i;
+	for (i = 0; i < w; i++)
+		memcpy(dst + i * bpp, pixel, bpp);
+	for (i = 1; i < h; i++)
+		memcpy(dst + i * stride, dst, w * bpp);
+}
+
+static INLINE void fillrect_n(char *pixel, int x, int y, int w, int h, int bpp)
+{
+	if (x < 0 || x + w > srv_cols || y < 0 || y + h > srv_rows)
+		return;
+	fill_n(pixel, rfb + ((long) y * srv_cols + x) * bpp, w, h, srv_cols * bpp, bpp);
+}
+
+/* decode a ZRLE tile; on z_short its pixels may be partially written */
+static INLINE void zrle_tile_n(int x, int y, int tw, int th, int bpp, int cpp)
+{
+	long stride = srv_cols * bpp;
+	char *row = rfb + ((long) y * srv_cols + x) * bpp;
+	char pixel[8] = {0};
+	int k, b;
+	u8 subenc = 0;
+	z_read(&subenc, 1);
+	if (subenc == 0) {
+		for (k = 0; k < th && z_outlen - z_outpos >= tw * cpp; k++) {
+			char *src = z_out.buf + z_outpos;
+			for (b = 0; b < tw; b++)
+				memcpy(row + b * bpp, src + b * cpp, cpp);
+			z_outpos += tw * cpp;
+			row += stride;
+		}
+		z_short |= k < th;
+	}
+	if (subenc == 1 && !z_read(pixel, cpp))
+		fill_n(pixel, row, tw, th, stride, bpp);
+	if ((subenc >= 2 && subenc <= 16) || subenc == 127) {
+		u8 line[32];
+		int cnt = subenc == 127 ? trle_npal : subenc;
+		int bits = cnt > 4 ? 4 : (cnt > 2 ? 2 : 1);
+		int wid = (bits * tw + 7) / 8;
+		int mask = (1 << bits) - 1;
+		if (subenc != 127 && !z_read(trle_pal, cnt * cpp))
+			trle_npal = cnt;
+		for (k = 0; k < th && !z_read(line, wid); k++) {
+			for (b = 0; b < tw; b++) {
+				int val = (line[b * bits / 8] >> (8 - (b * bits) % 8 - bits)) & mask;
+				memcpy(row + b * bpp, trle_pal + val * cpp, cpp);
+			}
+			row += stride;
+		}
+	}
+	if (subenc >= 128) {
+		int cnt = subenc == 129 ? trle_npal : subenc - 128;
+		int col = 0;
+		if (subenc >= 130 && !z_read(trle_pal, cnt * cpp))
+			trle_npal = cnt;
+		/* fill runs along the rows of the tile */
+		for (k = 0; k < th * tw && !z_short;) {
+			char *pix = pixel;
+			int rle = 1;
+			int rlen = 1;
+			int c;
+			if (!cnt) {
+				z_read(pixel, cpp);
+			} else {
+				u8 run = z_char();
+				pix = trle_pal + (run & 0x7f) * cpp;
+				rle = run & 0x80;
+			}
+			while (rle && (c = z_char()) == 255)
+				rlen += c;
+			rlen += rle ? c : 0;
+			if (z_short)
+				break;
+			rlen = MIN(rlen, th * tw - k);
+			k += rlen;
+			while (rlen > 0) {
+				int n = MIN(rlen, tw - col);
+				for (b = 0; b < n; b++)
+					memcpy(row + (col + b) * bpp, pix, cpp);
+				col += n;
+				rlen -= n;
+				if (col == tw) {
+					col = 0;
+					row += stride;
+				}
+			}
+		}
+	}
+}
+
+static void fillrect1(char *pixel, int x, int y, int w, int h)
+{
+	fillrect_n(pixel, x, y, w, h, 1);
+}
+
+static void fillrect2(char *pixel, int x, int y, int w, int h)
+{
+	fillrect_n(pixel, x, y, w, h, 2);
+}
+
+static void fillrect3(char *pixel, int x, int y, int w, int h)
+{
+	fillrect_n(pixel, x, y, w, h, 3);
+}
+
+static void fillrect4(char *pixel, int x, int y, int w, int h)
+{
+	fillrect_n(pixel, x, y, w, h, 4);
+}
+
+static void zrle_tile1(int x, int y, int tw, int th)
+{
+	zrle_tile_n(x, y, tw, th, 1, 1);
+}
+
+static void zrle_tile2(int x, int y, int tw, int th)
+{
+	zrle_tile_n(x, y, tw, th, 2, 2);
+}
+
+static void zrle_tile3(int x, int y, int tw, int th)
+{
+	zrle_tile_n(x, y, tw, th, 3, 3);
+}
+
+/* 32-bit pixels are sent as 24-bit compressed pixels */
+static void zrle_tile4(int x, int y, int tw, int th)
+{
+	zrle_tile_n(x, y, tw, th, 4, 3);
+}
+
+static struct decoder {
+	void (*fillrect)(char *pixel, int x, int y, int w, int h);
+	void (*zrle_tile)(int x, int y, int tw, int th);
+} decoders[] = {
+	{fillrect1, zrle_tile1},
+	{fillrect2, zrle_tile2},
+	{fillrect3, zrle_tile3},
+	{fillrect4, zrle_tile4},
+};
+static struct decoder *dec;	/* decoders for the current pixel size */
+
+static int unix_connect(char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (void *) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int vnc_connect(char *addr, char *port)
+{
+	struct addrinfo hints, *addrinfo;
+	int fd;
+
+	if (!strncmp("unix:", addr, 5))
+		return unix_connect(addr + 5);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if (getaddrinfo(addr, port, &hints, &addrinfo))
+		return -1;
+	fd = socket(addrinfo->ai_family, addrinfo->ai_socktype,
+			addrinfo->ai_protocol);
+
+	if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) == -1) {
+		close(fd);
+		freeaddrinfo(addrinfo);
+		return -1;
+	}
+	freeaddrinfo(addrinfo);
+	return fd;
+}
+
+static void fbmode_bits(int *rr, int *rg, int *rb)
+{
+	int mode = FBM_CLR(fb_mode());
+	*rr = (mode >> 8) & 0xf;
+	*rg = (mode >> 4) & 0xf;
+	*rb = (mode >> 0) & 0xf;
+}
+
+/* send the list of encodings; enc is preferred and lev is the compression level */
+static int vnc_encodings(int fd, int enc, int lev)
+{
+	struct vnc_setencoding enc_cmd;
+	int fixed[] = {VNC_ENC_ZRLE, VNC_ENC_TRLE, VNC_ENC_ZLIB, VNC_ENC_RRE,
+		VNC_ENC_RAW, VNC_ENC_EXTCLIP, VNC_ENC_EXTDESKTOPSIZE,
+		VNC_ENC_DESKTOPSIZE};
+	u32 encs[LEN(fixed) + 2];
+	int i, n = 0;
+	encs[n++] = htonl(enc);
+	for (i = 0; i < LEN(fixed); i++)
+		if (fixed[i] != enc)
+			encs[n++] = htonl(fixed[i]);
+	if (lev >= 0)
+		encs[n++] = htonl(VNC_ENC_COMPRESS(lev));
+	enc_cmd.type = VNC_SETENCODING;
+	enc_cmd.pad = 0;
+	enc_cmd.n = htons(n);
+	vwrite(fd, &enc_cmd, sizeof(enc_cmd));
+	return vwrite(fd, encs, n * sizeof(encs[0])) < 0 ? -1 : 0;
+}
+
+static struct encstat *enc_find(int enc)
+{
+	int i;
+	for (i = 0; i < LEN(enc_stat); i++)
+		if (enc_stat[i].enc == enc)
+			return &enc_stat[i];
+	return NULL;
+}
+
+/* estimated microseconds per pixel for enc at the current link rate */
+static double enc_cost(int enc)
+{
+	struct encstat *es = enc_find(enc);
+	return es->bpx / enc_rate + es->dpx;
+}
+
+/* re-evaluate the preferred encoding at the end of each period */
+static int enc_adapt(int fd)
+{
+	long cur = now();
+	struct encstat *zrle = enc_find(VNC_ENC_ZRLE);
+	struct encstat *trle = enc_find(VNC_ENC_TRLE);
+	int enc, lev;
+	int i;
+	if (cur - enc_beg < ENC_PERIOD)
+		return 0;
+	/* inflated ZRLE data is about what TRLE would have sent */
+	if (zrle->px > 0 && !trle->px)
+		trle->bpx = (trle->bpx + (double) zrle->nz / zrle->px) / 2;
+	for (i = 0; i < LEN(enc_stat); i++) {
+		struct encstat *es = &enc_stat[i];
+		if (es->px > 0) {
+			es->bpx = (es->bpx + (double) es->nr / es->px) / 2;
+			es->dpx = (es->dpx + (double) es->dec / es->px) / 2;
+		}
+		es->nr = 0;
+		es->nz = 0;
+		es->px = 0;
+		es->dec = 0;
+	}
+	/* small transfers are served from socket buffers and say nothing */
+	if (vnc_nr - enc_nr >= (256 << 10) && vnc_wait > enc_wait)
+		enc_rate = (double) (vnc_nr - enc_nr) / (vnc_wait - enc_wait);
+	enc_beg = cur;
+	enc_nr = vnc_nr;
+	enc_wait = vnc_wait;
+	if (!enc_auto || enc_rate <= 0)
+		return 0;
+	/* trle saves inflating on fast links; raw only if clearly faster */
+	enc = enc_cost(VNC_ENC_TRLE) < enc_cost(VNC_ENC_ZRLE) ?
+		VNC_ENC_TRLE : VNC_ENC_ZRLE;
+	if (enc_cost(VNC_ENC_RAW) * 2 < enc_cost(enc))
+		enc = VNC_ENC_RAW;
+	lev = enc_rate > 8 ? 1 : (enc_rate > 1 ? 6 : 9);
+	if (enc != VNC_ENC_ZRLE)
+		lev = enc_lev;
+	if (enc == enc_cur && lev == enc_lev) {
+		enc_hold = 0;
+		return 0;
+	}
+	if (enc != enc_next || lev != enc_nlev) {
+		enc_next = enc;
+		enc_nlev = lev;
+		enc_hold = 0;
+	}
+	if (++enc_hold < ENC_HOLD)
+		return 0;
+	enc_cur = enc;
+	enc_lev = lev;
+	enc_hold = 0;
+	return vnc_encodings(fd, enc_cur, enc_lev);
+}
+
+/* fit the viewport into the server screen */
+static void vnc_view(void)
+{
+	cols = MIN(srv_cols, rotate & 1 ? fb_rows() : fb_cols());
+	rows = MIN(srv_rows, rotate & 1 ? fb_cols() : fb_rows());
+	oc = MIN(oc, srv_cols - cols);
+	or = MIN(or, srv_rows - rows);
+	mr = rows / 2;
+	mc = cols / 2;
+}
+
+static int vnc_init(int fd, int enc)
+{
+	char buf[256];
+	char vncver[16];
+	int rr, rg, rb;
+	struct vnc_clientinit clientinit;
+	struct vnc_serverinit serverinit;
+	struct vnc_setpixelformat pixfmt_cmd;
+	int connstat = VNC_CONN_FAILED;
+
+	/* handshake */
+	if (vread(fd, vncver, 12) < 0)
+		return -1;
+	strcpy(vncver, "RFB 003.003\n");
+	vwrite(fd, vncver, 12);
+	if (vread(fd, &connstat, sizeof(connstat)) < 0)
+		return -1;
+	if (ntohl(connstat) != VNC_CONN_NOAUTH)
+		return -1;
+	clientinit.shared = 1;
+	vwrite(fd, &clientinit, sizeof(clientinit));
+	if (vread(fd, &serverinit, sizeof(serverinit)) < 0)
+		return -1;
+	if (vread(fd, buf, ntohl(serverinit.len)) < 0)
+		return -1;
+	srv_cols = ntohs(serverinit.w);
+	srv_rows = ntohs(serverinit.h);
+
+	vnc_view();
+	bpp = cmap_mode ? 1 : fbpp;
+	dec = &decoders[MAX(1, MIN(4, bpp)) - 1];
+
+	/* send framebuffer configuration; colour maps come from the server */
+	memset(&pixfmt_cmd, 0, sizeof(pixfmt_cmd));
+	pixfmt_cmd.type = VNC_SETPIXELFORMAT;
+	pixfmt_cmd.format.bpp = bpp << 3;
+	pixfmt_cmd.format.depth = bpp << 3;
+	pixfmt_cmd.format.bigendian = 0;
+	pixfmt_cmd.format.truecolor = !cmap_mode;
+	fbmode_bits(&rr, &rg, &rb);
+	if (!cmap_mode) {
+		pixfmt_cmd.format.rmax = htons((1 << rr) - 1);
+		pixfmt_cmd.format.gmax = htons((1 << rg) - 1);
+		pixfmt_cmd.format.bmax = htons((1 << rb) - 1);
+		/* assuming colors packed as RGB; shall handle other cases later */
+		pixfmt_cmd.format.rshl = rg + rb;
+		pixfmt_cmd.format.gshl = rb;
+		pixfmt_cmd.format.bshl = 0;
+	}
+	vwrite(fd, &pixfmt_cmd, sizeof(pixfmt_cmd));
+
+	/* send encodings */
+	enc_auto = enc < 0;
+	enc_cur = enc < 0 ? VNC_ENC_ZRLE : enc;
+	enc_find(VNC_ENC_RAW)->bpx = bpp;
+	enc_beg = now();
+	return vnc_encodings(fd, enc_cur, enc_lev);
+}
+
+#ifdef FBVNC_H264
+static void h264_reset(void)
+{
+	int i;
+	for (i = 0; i < H264CTX; i++)
+		avcodec_free_context(&h264_ctx[i].ctx);
+}
+#endif
+
+/* map rfb after a shm_head in a new shm_path, for other processes to read */
+static char *shm_map(void)
+{
+	long hlen = (sizeof(*shm) + 4095) & ~4095;
+	char tmp[1024];
+	int rr, rg, rb;
+	int fd;
+	/* readers of the old file keep a valid mapping; it is replaced, not resized */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", shm_path);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		return MAP_FAILED;
+	if (ftruncate(fd, hlen + rfb_len) < 0) {
+		close(fd);
+		unlink(tmp);
+		return MAP_FAILED;
+	}
+	shm = mmap(NULL, hlen + rfb_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		unlink(tmp);
+		return MAP_FAILED;
+	}
+	fbmode_bits(&rr, &rg, &rb);
+	if (cmap_mode)
+		rr = rg = rb = 0;
+	shm->magic = SHM_MAGIC;
+	shm->size = hlen;
+	shm->cols = srv_cols;
+	shm->rows = srv_rows;
+	shm->bpp = bpp;
+	shm->rbits = rr;
+	shm->gbits = rg;
+	shm->bbits = rb;
+	shm->rshl = rg + rb;
+	shm->gshl = rb;
+	shm->bshl = 0;
+	memcpy(shm->cmap, cmap_rgb, sizeof(shm->cmap));
+	if (rename(tmp, shm_path) < 0) {
+		munmap(shm, hlen + rfb_len);
+		shm = NULL;
+		unlink(tmp);
+		return MAP_FAILED;
+	}
+	return (char *) shm + hlen;
+}
+
+/* log a changed rect in the shared rfb header */
+static void shm_add(int x, int y, int w, int h)
+{
+	struct shm_rect *r = &shm->log[shm->nlog % SHM_LOG];
+	r->seq = shm->seq + 1;
+	r->x = x;
+	r->y = y;
+	r->w = w;
+	r->h = h;
+	__sync_synchronize();
+	shm->nlog++;
+}
+
+/* allocate rfb; pages are not backed by memory until written */
+static int rfb_init(void)
+{
+	rfb_len = (long) srv_rows * srv_cols * bpp;
+	if (shm_path)
+		rfb = shm_map();
+	else
+		rfb = mmap(NULL, rfb_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (rfb == MAP_FAILED)
+		return 1;
+	tcols = (srv_cols + TILE - 1) / TILE;
+	trows = (srv_rows + TILE - 1) / TILE;
+	if ((tiles = malloc(tcols * trows)) == NULL)
+		return 1;
+	memset(tiles, TILE_STALE, tcols * trows);
+	if ((tile_nr = calloc(tcols * trows, sizeof(tile_nr[0]))) == NULL)
+		return 1;
+	return 0;
+}
+
+static void rfb_free(void)
+{
+	if (shm)
+		munmap(shm, shm->size + rfb_len);
+	else
+		munmap(rfb, rfb_len);
+	shm = NULL;
+	free(tiles);
+	free(tile_nr);
+#ifdef FBVNC_H264
+	h264_reset();
+#endif
+}
+
+/* the snapshot file of the given server */
+static char *snap_name(char *host, char *port)
+{
+	char *path = malloc(strlen(snap_dir) + strlen(host) + strlen(port) + 3);
+	char *s;
+	sprintf(path, "%s/%s:%s", snap_dir, host, port);
+	for (s = path + strlen(snap_dir) + 1; *s; s++)
+		if (*s == '/')
+			*s = '_';
+	return path;
+}
+
+/* fill rfb with the snapshot saved on exit, if the screen has not changed */
+static int snap_load(void)
+{
+	struct stat st;
+	u32 *hdr;
+	int fd, ok;
+	if ((fd = open(snap_path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size != 4 * sizeof(hdr[0]) + rfb_len) {
+		close(fd);
+		return 0;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return 0;
+	ok = hdr[0] == SNAPMAGIC && hdr[1] == srv_cols && hdr[2] == srv_rows &&
+		hdr[3] == (cmap_mode ? 0 : fb_mode());
+	if (ok)
+		memcpy(rfb, hdr + 4, rfb_len);
+	munmap(hdr, st.st_size);
+	return ok;
+}
+
+/* save rfb for the next connection to the same server */
+static void snap_save(void)
+{
+	u32 hdr[4] = {SNAPMAGIC, srv_cols, srv_rows, cmap_mode ? 0 : fb_mode()};
+	char tmp[1024];
+	long nw = 0, n = 0;
+	int fd, i;
+	/* parts of the screen not received yet would be shown next time */
+	for (i = 0; i < tcols * trows; i++)
+		if (tiles[i] & TILE_STALE)
+			return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", snap_path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return;
+	if (write(fd, hdr, sizeof(hdr)) == sizeof(hdr))
+		while (nw < rfb_len && (n = write(fd, rfb + nw, rfb_len - nw)) > 0)
+			nw += n;
+	close(fd);
+	if (nw == rfb_len)
+		rename(tmp, snap_path);
+	else
+		unlink(tmp);
+}
+
+/* install the colour map in the framebuffer palette */
+static int cmap_load(void)
+{
+	unsigned short r[256], g[256], b[256];
+	int i;
+	for (i = 0; i < 256; i++) {
+		r[i] = ((cmap_rgb[i] >> 16) & 0xff) * 0x101;
+		g[i] = ((cmap_rgb[i] >> 8) & 0xff) * 0x101;
+		b[i] = (cmap_rgb[i] & 0xff) * 0x101;
+	}
+	return fb_setcmap(0, 256, r, g, b);
+}
+
+/* SetColourMapEntries: n entries of 16-bit red, green, and blue */
+static void cmap_set(int first, int n, u8 *dat)
+{
+	int i;
+	if (!cmap_mode)
+		return;
+	for (i = 0; i < n && first + i < 256; i++, dat += 6) {
+		cmap_rgb[first + i] = (dat[0] << 16) | (dat[2] << 8) | dat[4];
+		cmap_lut[first + i] = fb_val(dat[0], dat[2], dat[4]);
+	}
+	if (shm)
+		memcpy(shm->cmap, cmap_rgb, sizeof(shm->cmap));
+	if (sess_bg)
+		return;
+	if (cmap_mode == CMAP_FB)
+		cmap_load();
+	else
+		nodraw_ref = 1;
+}
+
+/* a grey colour map until the server sends one */
+static void cmap_init(void)
+{
+	int i;
+	for (i = 0; i < 256; i++) {
+		cmap_rgb[i] = i * 0x010101;
+		cmap_lut[i] = fb_val(i, i, i);
+	}
+	/* pseudocolour framebuffers show colour map indices as they are */
+	if (fbpp == 1 && !cmap_load())
+		cmap_mode = CMAP_FB;
+}
+
+/* clear the parts of the screen outside the viewport */
+static void drawclear(void)
+{
+	int fw = rotate & 1 ? rows : cols;
+	int fh = rotate & 1 ? cols : rows;
+	int i;
+	for (i = 0; i < fb_rows(); i++)
+		if (i >= fh || fw < fb_cols())
+			memset(fb_mem(i) + (i < fh ? fw * fbpp : 0), 0,
+				(fb_cols() - (i < fh ? fw : 0)) * fbpp);
+}
+
+/* the server screen was resized */
+static int vnc_resize(int w, int h)
+{
+	if (w == srv_cols && h == srv_rows)
+		return 0;
+	rfb_free();
+	srv_cols = w;
+	srv_rows = h;
+	vnc_view();
+	if (rfb_init())
+		return 1;
+	req_w = 0;
+	dmg_n = 0;
+	if (!sess_bg)
+		drawclear();
+	return 0;
+}
+
+/* set and clear TILE_* flags of the tiles intersecting the given rect */
+static void tile_mark(int x, int y, int w, int h, int set, int clr)
+{
+	int i, j;
+	for (i = y / TILE; i < (y + h + TILE - 1) / TILE; i++)
+		for (j = x / TILE; j < (x + w + TILE - 1) / TILE; j++)
+			tiles[i * tcols + j] = (tiles[i * tcols + j] & ~clr) | set;
+}
+
+/* the bounding box of the tiles with the given flags */
+static int tile_bbox(int flag, int *x, int *y, int *w, int *h)
+{
+	int bc = tcols, br = trows, ec = 0, er = 0;
+	int i, j;
+	for (i = 0; i < trows; i++) {
+		for (j = 0; j < tcols; j++) {
+			if (tiles[i * tcols + j] & flag) {
+				bc = MIN(bc, j);
+				br = MIN(br, i);
+				ec = MAX(ec, j + 1);
+				er = MAX(er, i + 1);
+			}
+		}
+	}
+	if (bc >= ec)
+		return 0;
+	*x = bc * TILE;
+	*y = br * TILE;
+	*w = MIN(srv_cols, ec * TILE) - *x;
+	*h = MIN(srv_rows, er * TILE) - *y;
+	return 1;
+}
+
+static int vnc_request(int fd, int inc, int x, int y, int w, int h)
+{
+	struct vnc_updaterequest fbup_req;
+	fbup_req.type = VNC_UPDATEREQUEST;
+	fbup_req.inc = inc;
+	fbup_req.x = htons(x);
+	fbup_req.y = htons(y);
+	fbup_req.w = htons(w);
+	fbup_req.h = htons(h);
+	return vwrite(fd, &fbup_req, sizeof(fbup_req)) < 0 ? -1 : 0;
+}
+
+/* request an update; stale tiles are requested non-incrementally */
+static int vnc_refresh(int fd, int inc)
+{
+	int x = 0, y = 0, w = srv_cols, h = srv_rows;
+	if (!inc || tile_bbox(TILE_STALE, &x, &y, &w, &h)) {
+		inc = 0;
+		req_x = x;
+		req_y = y;
+		req_w = w;
+		req_h = h;
+	}
+	return vnc_request(fd, inc, x, y, w, h);
+}
+
+/* updates were paused; rfb is still valid, so ask for changes to the viewport first */
+static int vnc_resume(int fd)
+{
+	int x = oc / TILE * TILE;
+	int y = or / TILE * TILE;
+	if (sess_bg)
+		return 0;
+	req_pending = 1;
+	return vnc_request(fd, 1, x, y,
+		MIN(srv_cols, (oc + cols + TILE - 1) / TILE * TILE) - x,
+		MIN(srv_rows, (or + rows + TILE - 1) / TILE * TILE) - y);
+}
+
+/* copy to the framebuffer, without reading it, in whole cache lines */
+static void fb_copy(char *d, char *s, long n)
+{
+#ifdef __SSE2__
+	long head = -(unsigned long) d & 63;
+	if (n >= 128) {
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+		/* non-temporal stores fill write-combining buffers at once */
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a0 = _mm_loadu_si128((void *) s);
+			__m128i a1 = _mm_loadu_si128((void *) (s + 16));
+			__m128i a2 = _mm_loadu_si128((void *) (s + 32));
+			__m128i a3 = _mm_loadu_si128((void *) (s + 48));
+			_mm_stream_si128((void *) d, a0);
+			_mm_stream_si128((void *) (d + 16), a1);
+			_mm_stream_si128((void *) (d + 32), a2);
+			_mm_stream_si128((void *) (d + 48), a3);
+		}
+	}
+#endif
+	memcpy(d, s, n);
+}
+
+/* draw n colour-mapped pixels from s to d, advancing s by step bytes */
+static void cmap_line(char *d, u8 *s, long step, int n)
+{
+	int i;
+	switch (fbpp) {
+	case 4:
+		for (i = 0; i < n; i++, d += 4, s += step)
+			memcpy(d, &cmap_lut[*s], 4);
+		break;
+	case 2:
+		for (i = 0; i < n; i++, d += 2, s += step)
+			memcpy(d, &cmap_lut[*s], 2);
+		break;
+	default:
+		for (i = 0; i < n; i++, d += fbpp, s += step)
+			memcpy(d, &cmap_lut[*s], fbpp);
+	}
+}
+
+static void fb_set(int r, int c, void *mem, int len)
+{
+	if (cmap_mode == CMAP_LUT)
+		cmap_line(fb_mem(r) + c * fbpp, mem, 1, len);
+	else
+		fb_copy(fb_mem(r) + c * fbpp, mem, (long) len * bpp);
+}
+
+/* copy n pixels from s to d, advancing s by step bytes per pixel */
+static void rot_line(char *d, char *s, long step, int n)
+{
+	int i;
+	if (cmap_mode == CMAP_LUT) {
+		cmap_line(d, (u8 *) s, step, n);
+		return;
+	}
+	switch (bpp) {
+	case 4:
+		i = 0;
+#ifdef __SSE2__
+		/* rows rotated by 180 degrees are reversed four pixels at a time */
+		for (; step == -4 && i + 4 <= n; i += 4, d += 16, s -= 16)
+			_mm_storeu_si128((void *) d,
+				_mm_shuffle_epi32(_mm_loadu_si128((void *) (s - 12)), 0x1b));
+#endif
+		for (; i < n; i++, d += 4, s += step)
+			memcpy(d, s, 4);
+		break;
+	case 3:
+		for (i = 0; i < n; i++, d += 3, s += step)
+			memcpy(d, s, 3);
+		break;
+	case 2:
+		for (i = 0; i < n; i++, d += 2, s += step)
+			memcpy(d, s, 2);
+		break;
+	default:
+		for (i = 0; i < n; i++, d += bpp, s += step)
+			memcpy(d, s, bpp);
+	}
+}
+
+/* draw the viewport rect at (c, r) rotated; each framebuffer row is written sequentially */
+static void rot_rect(int c, int r, int w, int h)
+{
+	long stride = srv_cols * bpp;
+	int i;
+	if (rotate == 2) {
+		for (i = r; i < r + h; i++)
+			rot_line(fb_mem(rows - 1 - i) + (cols - c - w) * fbpp,
+				RFB(oc + c + w - 1, or + i), -bpp, w);
+		return;
+	}
+	for (i = c; i < c + w; i++) {
+		if (rotate == 1)
+			rot_line(fb_mem(i) + (rows - r - h) * fbpp,
+				RFB(oc + i, or + r + h - 1), -stride, h);
+		else
+			rot_line(fb_mem(cols - 1 - i) + r * fbpp,
+				RFB(oc + i, or + r), stride, h);
+	}
+}
+
+#ifdef __SSE2__
+/* rotate 4x4 blocks of 32-bit pixels by transposing them in registers */
+static void rot_sse(int c, int r, int w, int h)
+{
+	__m128i a0, a1, a2, a3, t0, t1, t2, t3;
+	__m128i b[4];
+	int i, j, k;
+	for (i = r; i < r + h; i += 4) {
+		for (j = c; j < c + w; j += 4) {
+			/* rows are loaded bottom-up for clockwise rotation */
+			int y0 = rotate == 1 ? i + 3 : i;
+			int dy = rotate == 1 ? -1 : 1;
+			a0 = _mm_loadu_si128((void *) RFB(oc + j, or + y0));
+			a1 = _mm_loadu_si128((void *) RFB(oc + j, or + y0 + dy));
+			a2 = _mm_loadu_si128((void *) RFB(oc + j, or + y0 + dy * 2));
+			a3 = _mm_loadu_si128((void *) RFB(oc + j, or + y0 + dy * 3));
+			t0 = _mm_unpacklo_epi32(a0, a1);
+			t1 = _mm_unpacklo_epi32(a2, a3);
+			t2 = _mm_unpackhi_epi32(a0, a1);
+			t3 = _mm_unpackhi_epi32(a2, a3);
+			b[0] = _mm_unpacklo_epi64(t0, t1);
+			b[1] = _mm_unpackhi_epi64(t0, t1);
+			b[2] = _mm_unpacklo_epi64(t2, t3);
+			b[3] = _mm_unpackhi_epi64(t2, t3);
+			for (k = 0; k < 4; k++) {
+				if (rotate == 1)
+					_mm_storeu_si128(fb_mem(j + k) + (rows - i - 4) * 4, b[k]);
+				else
+					_mm_storeu_si128(fb_mem(cols - 1 - j - k) + i * 4, b[k]);
+			}
+		}
+	}
+}
+#endif
+
+/* draw the viewport rect at (c, r) rotated, RBLK x RBLK blocks at a time */
+static void fb_rot(int c, int r, int w, int h)
+{
+	int bw, bh;
+	int i, j;
+	for (i = r; i < r + h; i += RBLK) {
+		for (j = c; j < c + w; j += RBLK) {
+			bw = MIN(RBLK, c + w - j);
+			bh = MIN(RBLK, r + h - i);
+#ifdef __SSE2__
+			if (bpp == 4 && rotate != 2) {
+				rot_sse(j, i, bw & ~3, bh & ~3);
+				rot_rect(j + (bw & ~3), i, bw & 3, bh);
+				rot_rect(j, i + (bh & ~3), bw & ~3, bh & 3);
+				continue;
+			}
+#endif
+			rot_rect(j, i, bw, bh);
+		}
+	}
+}
+
+/* draw a visible rfb rect */
+static void blit_one(struct blit *b)
+{
+	int i;
+	if (rotate) {
+		fb_rot(b->c - oc, b->r - or, b->w, b->h);
+	} else {
+		for (i = b->r; i < b->r + b->h; i++)
+			fb_set(i - or, b->c - oc, RFB(b->c, i), b->w);
+	}
+}
+
+/* draw the queued blits not taken by other threads */
+static void blit_take(void)
+{
+	int k;
+	while ((k = __sync_fetch_and_add(&blit_next, 1)) < blit_cnt)
+		blit_one((struct blit *) blit_job.buf + k);
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+static void *blit_thread(void *arg)
+{
+	long gen = 0;
+	pthread_mutex_lock(&blit_lock);
+	while (1) {
+		while (blit_gen == gen)
+			pthread_cond_wait(&blit_go, &blit_lock);
+		gen = blit_gen;
+		pthread_mutex_unlock(&blit_lock);
+		blit_take();
+		pthread_mutex_lock(&blit_lock);
+		if (--blit_left == 0)
+			pthread_cond_signal(&blit_done);
+	}
+	return NULL;
+}
+
+/* start the blitter threads; n is the number of threads drawing a blit */
+static void blit_init(int n)
+{
+	pthread_attr_t attr;
+	pthread_t thd;
+	sigset_t all, old;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (blit_n = 1; blit_n < MIN(n, BLITMAX); blit_n++)
+		if (pthread_create(&thd, &attr, blit_thread, NULL))
+			break;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/* queue the visible part of an rfb rect, in bands of BLITROWS rows */
+static void blit_add(int c, int r, int w, int h)
+{
+	int bc = MAX(c, oc);
+	int br = MAX(r, or);
+	int ec = MIN(c + w, MIN(srv_cols, oc + cols));
+	int er = MIN(r + h, MIN(srv_rows, or + rows));
+	int i;
+	for (i = br; bc < ec && i < er; i += BLITROWS) {
+		struct blit b = {bc, i, ec - bc, MIN(BLITROWS, er - i)};
+		struct blit *q = scratch(&blit_job, (blit_cnt + 1) * sizeof(b));
+		if (!q) {	/* draw it now if it cannot be queued */
+			blit_one(&b);
+			continue;
+		}
+		q[blit_cnt++] = b;
+		blit_px += (long) b.w * b.h;
+	}
+}
+
+/* draw the queued blits; large ones are shared with the blitter threads */
+static void blit_flush(void)
+{
+	long beg = TRACE_NOW();
+	blit_next = 0;
+	if (blit_n > 1 && blit_cnt > 1 && blit_px >= BLITPAR) {
+		pthread_mutex_lock(&blit_lock);
+		blit_left = blit_n - 1;
+		blit_gen++;
+		pthread_cond_broadcast(&blit_go);
+		pthread_mutex_unlock(&blit_lock);
+		blit_take();
+		pthread_mutex_lock(&blit_lock);
+		while (blit_left)
+			pthread_cond_wait(&blit_done, &blit_lock);
+		pthread_mutex_unlock(&blit_lock);
+	} else {
+		blit_take();
+	}
+	blit_cnt = 0;
+	blit_px = 0;
+	TRACE("blit", beg);
+}
+
+static void drawfb(int c, int r, int w, int h)
+{
+	blit_add(c, r, w, h);
+	blit_flush();
+}
+
+/* draw dirty tiles, merging horizontally adjacent ones */
+static void drawdirty(void)
+{
+	int i, j, k;
+	for (i = 0; i < trows; i++) {
+		for (j = 0; j < tcols; j = k) {
+			for (k = j; k < tcols && tiles[i * tcols + k] & TILE_DIRTY; k++)
+				tiles[i * tcols + k] &= ~TILE_DIRTY;
+			if (k > j)
+				blit_add(j * TILE, i * TILE, (k - j) * TILE, TILE);
+			else
+				k++;
+		}
+	}
+	blit_flush();
+}
+
+/* set the screen pixel showing rfb pixel (x, y) */
+static void dmg_pix(int x, int y, unsigned val)
+{
+	int c = x - oc;
+	int r = y - or;
+	if (c < 0 || r < 0 || c >= cols || r >= rows)
+		return;
+	if (rotate == 1)
+		memcpy(fb_mem(c) + (rows - 1 - r) * fbpp, &val, fbpp);
+	else if (rotate == 2)
+		memcpy(fb_mem(rows - 1 - r) + (cols - 1 - c) * fbpp, &val, fbpp);
+	else if (rotate == 3)
+		memcpy(fb_mem(cols - 1 - c) + r * fbpp, &val, fbpp);
+	else
+		memcpy(fb_mem(r) + c * fbpp, &val, fbpp);
+}
+
+/* outline recently decoded rects, coloured by encoding and faded by age */
+static void dmg_draw(void)
+{
+	long t = now();
+	int i, j, k;
+	if (!dmg_new && t - dmg_last < DMGTICK)
+		return;
+	/* erase the outlines drawn last time */
+	for (i = 0; i < dmg_n; i++) {
+		struct dmg *d = &dmg[i];
+		drawfb(d->x, d->y, d->w, 1);
+		drawfb(d->x, d->y + d->h - 1, d->w, 1);
+		drawfb(d->x, d->y, 1, d->h);
+		drawfb(d->x + d->w - 1, d->y, 1, d->h);
+	}
+	for (i = 0, j = 0; i < dmg_n; i++)
+		if (t - dmg[i].t < DMGFADE)
+			dmg[j++] = dmg[i];
+	dmg_n = j;
+	for (i = 0; i < dmg_n; i++) {
+		struct dmg *d = &dmg[i];
+		int a = 255 - (t - d->t) * 192 / DMGFADE;
+		unsigned val;
+		switch (d->enc) {
+		case VNC_ENC_RAW:
+			val = fb_val(a, 0, 0);
+			break;
+		case VNC_ENC_RRE:
+			val = fb_val(a, a, 0);
+			break;
+		case VNC_ENC_ZLIB:
+			val = fb_val(0, 0, a);
+			break;
+		case VNC_ENC_ZRLE:
+			val = fb_val(0, a, 0);
+			break;
+		case VNC_ENC_TRLE:
+			val = fb_val(0, a, a);
+			break;
+		default:
+			val = fb_val(a, 0, a);
+		}
+		for (k = 0; k < d->w; k++) {
+			dmg_pix(d->x + k, d->y, val);
+			dmg_pix(d->x + k, d->y + d->h - 1, val);
+		}
+		for (k = 0; k < d->h; k++) {
+			dmg_pix(d->x, d->y + k, val);
+			dmg_pix(d->x + d->w - 1, d->y + k, val);
+		}
+	}
+	dmg_new = 0;
+	dmg_last = t;
+}
+
+/* save the number of bytes received for each tile */
+static void dmg_save(char *path)
+{
+	FILE *fp = fopen(path, "w");
+	int i, j;
+	if (!fp)
+		return;
+	fprintf(fp, "# bytes received per %dx%d tile\n", TILE, TILE);
+	for (i = 0; i < trows; i++)
+		for (j = 0; j < tcols; j++)
+			fprintf(fp, "%ld%c", tile_nr[i * tcols + j], j + 1 < tcols ? ' ' : '\n');
+	fclose(fp);
+}
+
+/* decode the ZRLE tiles whose data has arrived; return nonzero when done */
+static int readzrle(int x, int y, int w, int h, int ts)
+{
+	int tc = (w + ts - 1) / ts;
+	int n = tc * ((h + ts - 1) / ts);
+	while (rect_pos < n) {
+		int tx = x + (rect_pos % tc) * ts;
+		int ty = y + (rect_pos / tc) * ts;
+		int pos = z_outpos;
+		dec->zrle_tile(tx, ty, MIN(ts, x + w - tx), MIN(ts, y + h - ty));
+		if (z_short) {
+			z_short = 0;
+			z_outpos = pos;
+			return 0;
+		}
+		tile_mark(tx, ty, MIN(ts, x + w - tx), MIN(ts, y + h - ty), TILE_DIRTY, 0);
+		rect_pos++;
+	}
+	return 1;
+}
+
+/* return the next len bytes of received data, or NULL if not received yet */
+static void *iget(long len)
+{
+	if (ilen - ipos < len) {
+		ineed = len;
+		return NULL;
+	}
+	return ibuf.buf + ipos;
+}
+
+static void iskip(long len)
+{
+	ipos += len;
+	vnc_nc += len;
+}
+
+/* receive whatever the server has sent so far */
+static int vnc_recv(int fd)
+{
+	long beg = TRACE_NOW();
+	long n;
+	if (ipos) {
+		memmove(ibuf.buf, ibuf.buf + ipos, ilen - ipos);
+		ilen -= ipos;
+		ipos = 0;
+	}
+	if (!scratch(&ibuf, MAX(ilen + RECVCHUNK, ineed)))
+		return -1;
+	n = recv(fd, ibuf.buf + ilen, ibuf.size - ilen, MSG_DONTWAIT);
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	ilen += n;
+	vnc_nr += n;
+	TRACE("recv", beg);
+	return 0;
+}
+
+static int readraw(int fd)
+{
+	long len = (long) rect_w * rect_h * bpp;
+	long rowlen = rect_w * bpp;
+	long row = rect_pos / MAX(1, rowlen);
+	long n;
+	while (rect_pos < len) {
+		long off = rect_pos % rowlen;
+		char *dst = RFB(rect_x, rect_y + rect_pos / rowlen) + off;
+		if (ipos < ilen) {
+			/* full-width rects are contiguous in rfb */
+			n = MIN(ilen - ipos, rect_w == srv_cols ? len - rect_pos : rowlen - off);
+			memcpy(dst, ibuf.buf + ipos, n);
+			iskip(n);
+		} else if (rect_w == srv_cols) {
+			/* bulk transfers are received in place */
+			n = recv(fd, dst, len - rect_pos, MSG_DONTWAIT);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+				return -1;
+			if (n < 0)
+				break;
+			vnc_nr += n;
+			vnc_nc += n;
+		} else {
+			break;
+		}
+		rect_pos += n;
+	}
+	if (len)
+		tile_mark(rect_x, rect_y + row, rect_w,
+			(rect_pos + rowlen - 1) / rowlen - row, TILE_DIRTY, 0);
+	return rect_pos == len;
+}
+
+static int readrre(void)
+{
+	char pixel[8];
+	char *dat;
+	u32 n;
+	u16 pos[4];
+	int i;
+	if (!(dat = iget(4 + bpp)))
+		return 0;
+	memcpy(&n, dat, 4);
+	n = ntohl(n);
+	if (!(dat = iget(4 + bpp + (long) n * (bpp + 8))))
+		return 0;
+	dec->fillrect(dat + 4, rect_x, rect_y, rect_w, rect_h);
+	for (i = 0; i < n; i++) {
+		memcpy(pixel, dat + 4 + bpp + i * (bpp + 8), bpp);
+		memcpy(pos, dat + 4 + bpp + i * (bpp + 8) + bpp, 8);
+		dec->fillrect(pixel, rect_x + ntohs(pos[0]), rect_y + ntohs(pos[1]),
+			ntohs(pos[2]), ntohs(pos[3]));
+	}
+	iskip(4 + bpp + (long) n * (bpp + 8));
+	tile_mark(rect_x, rect_y, rect_w, rect_h, TILE_DIRTY, 0);
+	return 1;
+}
+
+/* inflate the compressed data received so far and decode it */
+static int readzlib(void)
+{
+	long beg = TRACE_NOW();
+	long n;
+	int done;
+	u32 zlen;
+	if (rect_left < 0) {
+		if (!iget(4))
+			return 0;
+		memcpy(&zlen, ibuf.buf + ipos, 4);
+		iskip(4);
+		rect_left = ntohl(zlen);
+		z_outlen = 0;
+		z_outpos = 0;
+	}
+	if ((n = MIN(ilen - ipos, rect_left)) > 0) {
+		if (z_push(ibuf.buf + ipos, n))
+			return -1;
+		iskip(n);
+		rect_left -= n;
+		TRACE("inflate", beg);
+	}
+	if (rect_enc == VNC_ENC_ZRLE) {
+		beg = TRACE_NOW();
+		done = readzrle(rect_x, rect_y, rect_w, rect_h, 64);
+		TRACE("zrle tiles", beg);
+	} else {
+		long row = rect_pos;
+		while (rect_pos < rect_h && z_outlen - z_outpos >= rect_w * bpp) {
+			z_read(RFB(rect_x, rect_y + rect_pos), rect_w * bpp);
+			rect_pos++;
+		}
+		tile_mark(rect_x, rect_y + row, rect_w, rect_pos - row, TILE_DIRTY, 0);
+		done = rect_pos == rect_h;
+	}
+	if (!done && !rect_left)
+		return -1;
+	return done && !rect_left;
+}
+
+#ifdef FBVNC_H264
+/* convert a row of 4:2:0 pixels; u and v are subsampled horizontally */
+static void yuv_row(char *dst, u8 *y, u8 *u, u8 *v, int n, int rr, int rg, int rb)
+{
+	int i = 0;
+#ifdef __SSE2__
+	/* 8 pixels at a time in 16-bit lanes, with 6 fraction bits */
+	if (bpp == 4 && rr == 8 && rg == 8 && rb == 8) {
+		__m128i z = _mm_setzero_si128();
+		__m128i yy, uu, vv, c, r, g, b, bg, r0;
+		int u4, v4;
+		for (; i + 8 <= n; i += 8) {
+			memcpy(&u4, u + i / 2, 4);
+			memcpy(&v4, v + i / 2, 4);
+			yy = _mm_unpacklo_epi8(_mm_loadl_epi64((void *) (y + i)), z);
+			uu = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), z);
+			vv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), z);
+			uu = _mm_sub_epi16(_mm_unpacklo_epi16(uu, uu), _mm_set1_epi16(128));
+			vv = _mm_sub_epi16(_mm_unpacklo_epi16(vv, vv), _mm_set1_epi16(128));
+			c = _mm_mullo_epi16(_mm_sub_epi16(yy, _mm_set1_epi16(16)), _mm_set1_epi16(74));
+			c = _mm_add_epi16(c, _mm_set1_epi16(32));
+			/* saturation only happens for components above 255 */
+			r = _mm_adds_epi16(c, _mm_mullo_epi16(vv, _mm_set1_epi16(102)));
+			g = _mm_sub_epi16(c, _mm_add_epi16(_mm_mullo_epi16(uu, _mm_set1_epi16(25)),
+				_mm_mullo_epi16(vv, _mm_set1_epi16(52))));
+			b = _mm_adds_epi16(c, _mm_mullo_epi16(uu, _mm_set1_epi16(129)));
+			r = _mm_packus_epi16(_mm_srai_epi16(r, 6), z);
+			g = _mm_packus_epi16(_mm_srai_epi16(g, 6), z);
+			b = _mm_packus_epi16(_mm_srai_epi16(b, 6), z);
+			bg = _mm_unpacklo_epi8(b, g);
+			r0 = _mm_unpacklo_epi8(r, z);
+			_mm_storeu_si128((void *) (dst + i * 4), _mm_unpacklo_epi16(bg, r0));
+			_mm_storeu_si128((void *) (dst + i * 4 + 16), _mm_unpackhi_epi16(bg, r0));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		int c = 74 * (y[i] - 16) + 32;
+		int d = u[i / 2] - 128;
+		int e = v[i / 2] - 128;
+		int r = MAX(0, MIN(255, (c + 102 * e) >> 6));
+		int g = MAX(0, MIN(255, (c - 25 * d - 52 * e) >> 6));
+		int b = MAX(0, MIN(255, (c + 129 * d) >> 6));
+		unsigned val = ((r >> (8 - rr)) << (rg + rb)) | ((g >> (8 - rg)) << rb) | (b >> (8 - rb));
+		memcpy(dst + i * bpp, &val, bpp);
+	}
+}
+
+/* copy a decoded frame into rfb */
+static void h264_blit(struct h264 *hc, AVFrame *frm)
+{
+	int w = MIN(hc->w, frm->width);
+	int h = MIN(hc->h, frm->height);
+	int rr, rg, rb;
+	int i;
+	if (frm->format != AV_PIX_FMT_YUV420P && frm->format != AV_PIX_FMT_YUVJ420P)
+		return;
+	fbmode_bits(&rr, &rg, &rb);
+	for (i = 0; i < h; i++)
+		yuv_row(RFB(hc->x, hc->y + i), frm->data[0] + i * frm->linesize[0],
+			frm->data[1] + i / 2 * frm->linesize[1],
+			frm->data[2] + i / 2 * frm->linesize[2], w, rr, rg, rb);
+	tile_mark(hc->x, hc->y, w, h, TILE_DIRTY, 0);
+}
+
+/* the decoder of the given rect, if any */
+static struct h264 *h264_find(int x, int y, int w, int h)
+{
+	struct h264 *hc;
+	int i;
+	for (i = 0; i < H264CTX; i++) {
+		hc = &h264_ctx[i];
+		if (hc->ctx && hc->x == x && hc->y == y && hc->w == w && hc->h == h)
+			return hc;
+	}
+	return NULL;
+}
+
+/* a new decoder for the given rect; the oldest is replaced if none is free */
+static struct h264 *h264_new(int x, int y, int w, int h)
+{
+	struct h264 *hc = NULL;
+	int i;
+	if (!h264_codec && !(h264_codec = avcodec_find_decoder(AV_CODEC_ID_H264)))
+		return NULL;
+	if (!h264_pkt && !(h264_pkt = av_packet_alloc()))
+		return NULL;
+	if (!h264_frm && !(h264_frm = av_frame_alloc()))
+		return NULL;
+	for (i = 0; i < H264CTX && !hc; i++)
+		if (!h264_ctx[i].ctx)
+			hc = &h264_ctx[i];
+	if (!hc) {
+		hc = &h264_ctx[h264_old++ % H264CTX];
+		avcodec_free_context(&hc->ctx);
+	}
+	if (!(hc->ctx = avcodec_alloc_context3(h264_codec)))
+		return NULL;
+	hc->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	if (avcodec_open2(hc->ctx, h264_codec, NULL) < 0) {
+		avcodec_free_context(&hc->ctx);
+		return NULL;
+	}
+	hc->x = x;
+	hc->y = y;
+	hc->w = w;
+	hc->h = h;
+	return hc;
+}
+
+/* open h.264 rects: data length, flags and H.264 data */
+static int readh264(void)
+{
+	struct h264 *hc;
+	u32 hdr[2];
+	long len;
+	char *dat;
+	if (!(dat = iget(8)))
+		return 0;
+	memcpy(hdr, dat, 8);
+	len = ntohl(hdr[0]);
+	if (!(dat = iget(8 + len)))
+		return 0;
+	if (ntohl(hdr[1]) & VNC_H264_RESETALL)
+		h264_reset();
+	hc = h264_find(rect_x, rect_y, rect_w, rect_h);
+	if (hc && ntohl(hdr[1]) & VNC_H264_RESET) {
+		avcodec_free_context(&hc->ctx);
+		hc = NULL;
+	}
+	if (!hc && !(hc = h264_new(rect_x, rect_y, rect_w, rect_h)))
+		return -1;
+	if (!scratch(&h264_buf, len + AV_INPUT_BUFFER_PADDING_SIZE))
+		return -1;
+	memcpy(h264_buf.buf, dat + 8, len);
+	memset(h264_buf.buf + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	iskip(8 + len);
+	if (!len)
+		return 1;
+	h264_pkt->data = (void *) h264_buf.buf;
+	h264_pkt->size = len;
+	/* decoding errors are left for the next key frame to fix */
+	if (avcodec_send_packet(hc->ctx, h264_pkt) == 0)
+		while (avcodec_receive_frame(hc->ctx, h264_frm) == 0)
+			h264_blit(hc, h264_frm);
+	return 1;
+}
+#endif
+
+/* TRLE: ZRLE's 16x16 tiles without zlib; the tile decoders read ibuf in place */
+static int readtrle(void)
+{
+	struct scratch zs = z_out;
+	int zlen = z_outlen;
+	int zpos = z_outpos;
+	int done;
+	z_out.buf = ibuf.buf;
+	z_outlen = ilen;
+	z_outpos = ipos;
+	done = readzrle(rect_x, rect_y, rect_w, rect_h, 16);
+	iskip(z_outpos - ipos);
+	z_out = zs;
+	z_outlen = zlen;
+	z_outpos = zpos;
+	return done;
+}
+
+/* record a decoded rect for the damage overlay and per-tile statistics */
+static void dmg_add(int x, int y, int w, int h, int enc, long nr)
+{
+	int n = ((x + w + TILE - 1) / TILE - x / TILE) * ((y + h + TILE - 1) / TILE - y / TILE);
+	int i, j;
+	for (i = y / TILE; i < (y + h + TILE - 1) / TILE; i++)
+		for (j = x / TILE; j < (x + w + TILE - 1) / TILE; j++)
+			tile_nr[i * tcols + j] += nr / MAX(1, n);
+	/* the outlines belong to the visible session */
+	if (!dmg_on || sess_bg)
+		return;
+	if (dmg_n == DMGMAX)
+		memmove(dmg, dmg + 1, --dmg_n * sizeof(dmg[0]));
+	dmg[dmg_n].x = x;
+	dmg[dmg_n].y = y;
+	dmg[dmg_n].w = w;
+	dmg[dmg_n].h = h;
+	dmg[dmg_n].enc = enc;
+	dmg[dmg_n].t = now();
+	dmg_n++;
+	dmg_new = 1;
+}
+
+/* ask the server to resize its screen to that of the framebuffer */
+static int vnc_fit(int fd, u32 id)
+{
+	struct vnc_setdesktopsize ds = {VNC_SETDESKTOPSIZE};
+	struct vnc_screen scr = {0};
+	int w = rotate & 1 ? fb_rows() : fb_cols();
+	int h = rotate & 1 ? fb_cols() : fb_rows();
+	dsk_sent = 1;
+	if (w == srv_cols && h == srv_rows)
+		return 0;
+	ds.w = htons(w);
+	ds.h = htons(h);
+	ds.n = 1;
+	scr.id = id;
+	scr.w = ds.w;
+	scr.h = ds.h;
+	vwrite(fd, &ds, sizeof(ds));
+	return vwrite(fd, &scr, sizeof(scr)) < 0 ? -1 : 0;
+}
+
+/* DesktopSize and ExtendedDesktopSize pseudo-rects */
+static int readdesktop(int fd)
+{
+	struct vnc_screen scr = {0};
+	char *dat;
+	long n = 0;
+	if (rect_enc == VNC_ENC_EXTDESKTOPSIZE) {
+		if (!(dat = iget(4)))
+			return 0;
+		n = 4 + (unsigned char) dat[0] * sizeof(scr);
+		if (!(dat = iget(n)))
+			return 0;
+		if (n > 4)
+			memcpy(&scr, dat + 4, sizeof(scr));
+		iskip(n);
+	}
+	if (vnc_resize(rect_w, rect_h))
+		return -1;
+	/* SetDesktopSize requires ExtendedDesktopSize support */
+	if (rect_enc == VNC_ENC_EXTDESKTOPSIZE && dsk_fit && !dsk_sent)
+		return vnc_fit(fd, scr.id) ? -1 : 1;
+	return 1;
+}
+
+/* decode the rect data received so far; return nonzero when done */
+static int readrect(int fd)
+{
+	struct vnc_rect uprect;
+	struct encstat *es;
+	long beg = now();
+	long nc = vnc_nc;
+	long nz = z_nout;
+	char *dat;
+	int ret = -1;
+	if (!rect_busy) {
+		if (!(dat = iget(sizeof(uprect))))
+			return 0;
+		rect_nc = vnc_nc;
+		memcpy(&uprect, dat, sizeof(uprect));
+		iskip(sizeof(uprect));
+		rect_x = ntohs(uprect.x);
+		rect_y = ntohs(uprect.y);
+		rect_w = ntohs(uprect.w);
+		rect_h = ntohs(uprect.h);
+		rect_enc = ntohl(uprect.enc);
+		if (rect_enc != VNC_ENC_DESKTOPSIZE && rect_enc != VNC_ENC_EXTDESKTOPSIZE &&
+				(rect_x + rect_w > srv_cols || rect_y + rect_h > srv_rows))
+			return -1;
+		rect_busy = 1;
+		rect_pos = 0;
+		rect_left = -1;
+	}
+	switch (rect_enc) {
+	case VNC_ENC_RAW:
+		ret = readraw(fd);
+		break;
+	case VNC_ENC_RRE:
+		ret = readrre();
+		break;
+	case VNC_ENC_ZLIB:
+	case VNC_ENC_ZRLE:
+		ret = readzlib();
+		break;
+	case VNC_ENC_TRLE:
+		ret = readtrle();
+		break;
+#ifdef FBVNC_H264
+	case VNC_ENC_H264:
+		ret = readh264();
+		break;
+#endif
+	case VNC_ENC_DESKTOPSIZE:
+	case VNC_ENC_EXTDESKTOPSIZE:
+		if ((ret = readdesktop(fd)) > 0)
+			rect_busy = 0;
+		return ret;
+	default:
+		fprintf(stderr, "fbvnc: unknown encoding %d\n", rect_enc);
+	}
+	if ((es = enc_find(rect_enc)) != NULL) {
+		es->nr += vnc_nc - nc;
+		es->nz += z_nout - nz;
+		es->px += ret > 0 ? rect_w * rect_h : 0;
+		es->dec += now() - beg;
+	}
+	if (ret > 0) {
+		rect_busy = 0;
+		if (shm)
+			shm_add(rect_x, rect_y, rect_w, rect_h);
+		dmg_add(rect_x, rect_y, rect_w, rect_h, rect_enc, vnc_nc - rect_nc);
+	}
+	return ret;
+}
+
+/* start writing the incoming cut text; icut_write() writes it in chunks */
+static int icut_copy(char *buf, int len)
 {
-	inflateEnd(&z_str);
-	free(z_out);
+	if (icut_fd >= 0)
+		close(icut_fd);
+	icut_fd = icut != NULL ? open(icut, O_WRONLY | O_TRUNC | O_CREAT, 0600) : -1;
+	if (icut_fd < 0 || !scratch(&icut_buf, len))
+		return 1;
+	memcpy(icut_buf.buf, buf, len);
+	icut_len = len;
+	icut_pos = 0;
 	return 0;
 }
 
-static int vnc_connect(char *addr, char *port)
+static void icut_write(void)
 {
-	struct addrinfo hints, *addrinfo;
-	int fd;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-
-	if (getaddrinfo(addr, port, &hints, &addrinfo))
-		return -1;
-	fd = socket(addrinfo->ai_family, addrinfo->ai_socktype,
-			addrinfo->ai_protocol);
+	long n = write(icut_fd, icut_buf.buf + icut_pos, MIN(CUTCHUNK, icut_len - icut_pos));
+	if (n > 0)
+		icut_pos += n;
+	if (n <= 0 || icut_pos >= icut_len) {
+		close(icut_fd);
+		icut_fd = -1;
+	}
+}
 
-	if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) == -1) {
-		close(fd);
-		freeaddrinfo(addrinfo);
+/* inflate a complete zlib stream into dst, up to max bytes */
+static long z_inflate(struct scratch *dst, void *src, long len, long max)
+{
+	z_stream z = {Z_NULL};
+	long n = 0;
+	int ret = Z_OK;
+	if (inflateInit(&z) != Z_OK)
 		return -1;
+	z.next_in = src;
+	z.avail_in = len;
+	while (ret == Z_OK && n < max) {
+		if (!scratch(dst, MIN(max, n + 4096)))
+			break;
+		z.next_out = (void *) dst->buf + n;
+		z.avail_out = MIN(max, dst->size) - n;
+		ret = inflate(&z, Z_NO_FLUSH);
+		n = (char *) z.next_out - dst->buf;
 	}
-	freeaddrinfo(addrinfo);
-	return fd;
+	inflateEnd(&z);
+	/* longer text is truncated */
+	return ret == Z_STREAM_END || ret == Z_BUF_ERROR || n >= max ? n : -1;
 }
 
-static void fbmode_bits(int *rr, int *rg, int *rb)
+/* send an extended clipboard message */
+static int clip_msg(int fd, u32 flags, void *data, long len)
 {
-	int mode = FBM_CLR(fb_mode());
-	*rr = (mode >> 8) & 0xf;
-	*rg = (mode >> 4) & 0xf;
-	*rb = (mode >> 0) & 0xf;
+	struct vnc_cuttext ct = {VNC_CLIENTCUTTEXT};
+	ct.len = htonl(-(4 + len));
+	flags = htonl(flags);
+	vwrite(fd, &ct, sizeof(ct));
+	vwrite(fd, &flags, 4);
+	return vwrite(fd, data, len) < 0 ? -1 : 0;
 }
 
-static int vnc_init(int fd, int enc)
+static int clip_caps_send(int fd)
 {
-	char buf[256];
-	char vncver[16];
-	int rr, rg, rb;
-	struct vnc_clientinit clientinit;
-	struct vnc_serverinit serverinit;
-	struct vnc_setpixelformat pixfmt_cmd;
-	struct vnc_setencoding enc_cmd;
-	u32 encs[] = {htonl(VNC_ENC_ZRLE), htonl(VNC_ENC_ZLIB), htonl(VNC_ENC_RRE), htonl(VNC_ENC_RAW)};
-	int connstat = VNC_CONN_FAILED;
-
-	/* handshake */
-	if (vread(fd, vncver, 12) < 0)
-		return -1;
-	strcpy(vncver, "RFB 003.003\n");
-	vwrite(fd, vncver, 12);
-	if (vread(fd, &connstat, sizeof(connstat)) < 0)
-		return -1;
-	if (ntohl(connstat) != VNC_CONN_NOAUTH)
-		return -1;
-	clientinit.shared = 1;
-	vwrite(fd, &clientinit, sizeof(clientinit));
-	if (vread(fd, &serverinit, sizeof(serverinit)) < 0)
-		return -1;
-	if (vread(fd, buf, ntohl(serverinit.len)) < 0)
-		return -1;
-	srv_cols = ntohs(serverinit.w);
-	srv_rows = ntohs(serverinit.h);
-
-	cols = MIN(srv_cols, fb_cols());
-	rows = MIN(srv_rows, fb_rows());
-	bpp = FBM_BPP(fb_mode());
-	mr = rows / 2;
-	mc = cols / 2;
-
-	/* send framebuffer configuration */
-	pixfmt_cmd.type = VNC_SETPIXELFORMAT;
-	pixfmt_cmd.format.bpp = bpp << 3;
-	pixfmt_cmd.format.depth = bpp << 3;
-	pixfmt_cmd.format.bigendian = 0;
-	pixfmt_cmd.format.truecolor = 1;
-	fbmode_bits(&rr, &rg, &rb);
-	pixfmt_cmd.format.rmax = htons((1 << rr) - 1);
-	pixfmt_cmd.format.gmax = htons((1 << rg) - 1);
-	pixfmt_cmd.format.bmax = htons((1 << rb) - 1);
-
-	/* assuming colors packed as RGB; shall handle other cases later */
-	pixfmt_cmd.format.rshl = rg + rb;
-	pixfmt_cmd.format.gshl = rb;
-	pixfmt_cmd.format.bshl = 0;
-	vwrite(fd, &pixfmt_cmd, sizeof(pixfmt_cmd));
-
-	/* send pixel format */
-	enc_cmd.type = VNC_SETENCODING;
-	enc_cmd.pad = 0;
-	if (enc >= 0)
-		encs[0] = htonl(enc);
-	enc_cmd.n = htons(LEN(encs));
-	vwrite(fd, &enc_cmd, sizeof(enc_cmd));
-	vwrite(fd, encs, ntohs(enc_cmd.n) * sizeof(encs[0]));
-	return 0;
+	u32 maxlen = htonl(CUTMAX);
+	return clip_msg(fd, VNC_CLIP_CAPS | VNC_CLIP_TEXT | VNC_CLIP_REQUEST |
+		VNC_CLIP_PEEK | VNC_CLIP_NOTIFY | VNC_CLIP_PROVIDE, &maxlen, 4);
 }
 
-static int vnc_refresh(int fd, int inc)
+/* send the compressed text */
+static int clip_provide(int fd)
 {
-	struct vnc_updaterequest fbup_req;
-	fbup_req.type = VNC_UPDATEREQUEST;
-	fbup_req.inc = inc;
-	fbup_req.x = htons(0);
-	fbup_req.y = htons(0);
-	fbup_req.w = htons(srv_cols);
-	fbup_req.h = htons(srv_rows);
-	return vwrite(fd, &fbup_req, sizeof(fbup_req)) < 0 ? -1 : 0;
+	if (!clip_ready) {
+		clip_want = 1;
+		return 0;
+	}
+	return clip_msg(fd, VNC_CLIP_PROVIDE | VNC_CLIP_TEXT, clip_out.buf, clip_outlen);
 }
 
-static void fb_set(int r, int c, void *mem, int len)
+/* handle an extended clipboard message from the server */
+static int clip_event(int fd, char *msg, long len)
 {
-	memcpy(fb_mem(r) + c * bpp, mem, len * bpp);
+	u32 flags;
+	long n, i, j;
+	if (len < 4)
+		return -1;
+	memcpy(&flags, msg, 4);
+	flags = ntohl(flags);
+	if (flags & VNC_CLIP_CAPS) {
+		clip_caps = flags;
+		/* the size of text, the first format, follows the flags */
+		if (flags & VNC_CLIP_TEXT && len >= 8)
+			clip_tmax = ntohl(*(u32 *) (msg + 4));
+		return clip_caps_send(fd);
+	}
+	if (flags & VNC_CLIP_REQUEST && flags & VNC_CLIP_TEXT && clip_len)
+		return clip_provide(fd);
+	if (flags & VNC_CLIP_PEEK)
+		return clip_msg(fd, VNC_CLIP_NOTIFY | (clip_len ? VNC_CLIP_TEXT : 0), NULL, 0);
+	if (flags & VNC_CLIP_NOTIFY && flags & VNC_CLIP_TEXT && icut)
+		return clip_msg(fd, VNC_CLIP_REQUEST | VNC_CLIP_TEXT, NULL, 0);
+	if (flags & VNC_CLIP_PROVIDE && flags & VNC_CLIP_TEXT) {
+		if ((n = z_inflate(&clip_zbuf, msg + 4, len - 4, 4 + CUTMAX)) < 4)
+			return 0;
+		msg = clip_zbuf.buf;
+		n = MIN(n - 4, ntohl(*(u32 *) msg));
+		/* remove the trailing nul and convert CRLF to LF */
+		for (i = 0, j = 0; i < n && msg[4 + i]; i++)
+			if (msg[4 + i] != '\r' || i + 1 == n || msg[4 + i + 1] != '\n')
+				msg[j++] = msg[4 + i];
+		icut_copy(msg, j);
+	}
+	return 0;
 }
 
-static void drawfb(int c, int r, int w, int h)
+/* stop sending ocut */
+static void ocut_stop(void)
 {
-	int bc = MAX(c, oc);
-	int br = MAX(r, or);
-	int ec = MIN(c + w, MIN(srv_cols, oc + cols));
-	int er = MIN(r + h, MIN(srv_rows, or + rows));
-	int i;
-	if (bc < ec) {
-		for (i = br; i < er; i++)
-			fb_set(i - or, bc - oc, RFB(bc, i), ec - bc);
-	}
+	if (ocut_fd >= 0)
+		close(ocut_fd);
+	if (ocut_zon)
+		deflateEnd(&ocut_z);
+	ocut_fd = -1;
+	ocut_zon = 0;
 }
 
-static void fillrect(char *pixel, int x, int y, int w, int h)
+/* start sending the contents of ocut; ocut_step() reads and compresses it */
+static int ocut_copy(int fd)
 {
-	int i;
-	if (x < 0 || x + w > srv_cols || y < 0 || y + h > srv_rows)
-		return;
-	for (i = 0; i < w; i++)
-		memcpy(RFB(x + i, y), pixel, bpp);
-	for (i = 1; i < h; i++)
-		memcpy(RFB(x, y + i), RFB(x, y), w * bpp);
+	ocut_stop();
+	if (!ocut || (ocut_fd = open(ocut, O_RDONLY)) < 0)
+		return 1;
+	clip_len = 0;
+	clip_tlen = 1;
+	clip_ready = 0;
+	clip_want = 0;
+	ocut_max = CUTMAX;
+	if (clip_caps & VNC_CLIP_PROVIDE && clip_tmax > 0)
+		ocut_max = MIN(CUTMAX, clip_tmax);
+	return 0;
 }
 
-static int readzrle(int x, int y, int w, int h)
+/* the text is read; notify the server or send it */
+static int ocut_done(int fd)
 {
-	char pixel[8] = {0};
-	int i, j, k, b;
-	int cpp = bpp == 4 ? 3 : bpp;
-	u8 subenc = 0;
-	for (i = 0; i < h; i += 64) {
-		for (j = 0; j < w; j += 64) {
-			int tw = MIN(w - j, 64);
-			int th = MIN(h - i, 64);
-			z_read(&subenc, 1);
-			if (subenc == 0) {
-				for (k = 0; k < th; k++)
-					for (b = 0; b < tw; b++)
-						z_read(RFB(x + j + b, y + i + k), cpp);
-			}
-			if (subenc == 1) {
-				z_read(pixel, cpp);
-				fillrect(pixel, x + j, y + i, tw, th);
-			}
-			if (subenc >= 2 && subenc <= 16) {
-				char palette[16 * 4];
-				char row[32];
-				int bits = 1;
-				int wid, mask;
-				z_read(palette, subenc * cpp);
-				if (subenc >= 3)
-					bits = 2;
-				if (subenc >= 5)
-					bits = 4;
-				wid = (bits * tw + 7) / 8;
-				mask = (1 << bits) - 1;
-				for (k = 0; k < th; k++) {
-					z_read(row, wid);
-					for (b = 0; b < tw; b++) {
-						int idx = (b * bits) / 8;
-						int off = 8 - (b * bits) % 8 - bits;
-						int val = (((unsigned char) row[idx]) >> off) & mask;
-						memcpy(RFB(x + j + b, y + i + k),
-							palette + val * cpp, cpp);
-					}
-				}
-			}
-			if (subenc == 128) {
-				k = 0;
-				while (k < th * tw) {
-					int rlen = 1;
-					int c;
-					z_read(pixel, cpp);
-					while ((c = z_char()) == 255)
-						rlen += c;
-					rlen += c;
-					while (--rlen >= 0 && k < th * tw) {
-						memcpy(RFB(x + j + (k % tw), y + i + (k / tw)), pixel, cpp);
-						k++;
-					}
-				}
-			}
-			if (subenc >= 130 && subenc <= 255) {
-				char palette[128 * 4];
-				int cnt = subenc - 128;
-				z_read(palette, cnt * cpp);
-				k = 0;
-				while (k < th * tw) {
-					u8 run = z_char();
-					if (run & 0x80) {
-						int rlen = 1;
-						int c;
-						while ((c = z_char()) == 255)
-							rlen += c;
-						rlen += c;
-						while (--rlen >= 0 && k < th * tw) {
-							memcpy(RFB(x + j + (k % tw), y + i + (k / tw)),
-								palette + (run - 128) * cpp, cpp);
-							k++;
-						}
-					} else {
-						memcpy(RFB(x + j + (k % tw), y + i + (k / tw)),
-							palette + run * cpp, cpp);
-						k++;
-					}
-				}
-			}
-		}
+	struct vnc_cuttext ct = {VNC_CLIENTCUTTEXT};
+	if (clip_caps & VNC_CLIP_PROVIDE) {
+		if (clip_caps & VNC_CLIP_NOTIFY && !clip_want)
+			return clip_msg(fd, VNC_CLIP_NOTIFY | VNC_CLIP_TEXT, NULL, 0);
+		return clip_provide(fd);
 	}
-	return 0;
+	if (!clip_len)
+		return 0;
+	ct.len = htonl(clip_len);
+	vwrite(fd, &ct, sizeof(ct));
+	return vwrite(fd, clip_buf.buf, clip_len) < 0 ? -1 : 0;
 }
 
-static int readrect(int fd)
+/* read or compress the next CUTCHUNK bytes of ocut */
+static int ocut_step(int fd)
 {
-	struct vnc_rect uprect;
-	int x, y, w, h;
-	int i;
-	if (vread(fd, &uprect, sizeof(uprect)) <  0)
-		return -1;
-	x = ntohs(uprect.x);
-	y = ntohs(uprect.y);
-	w = ntohs(uprect.w);
-	h = ntohs(uprect.h);
-	if (x < 0 || w < 0 || x + w > srv_cols)
-		return -1;
-	if (y < 0 || h < 0 || y + h > srv_rows)
-		return -1;
-	if (uprect.enc == htonl(VNC_ENC_RAW)) {
-		for (i = 0; i < h; i++) {
-			if (vread(fd, RFB(x, y + i), w * bpp) < 0)
-				return -1;
+	char *text;
+	long n = 0, i, k;
+	int ret;
+	if (ocut_fd >= 0) {
+		if (scratch(&clip_buf, clip_len + CUTCHUNK))
+			n = read(ocut_fd, clip_buf.buf + clip_len, CUTCHUNK);
+		/* stop before the text with CRLF line breaks exceeds ocut_max */
+		for (i = 0; i < n && clip_len < ocut_max; i++, clip_len++) {
+			k = clip_buf.buf[clip_len] == '\n' &&
+				(!clip_len || clip_buf.buf[clip_len - 1] != '\r') ? 2 : 1;
+			if (clip_tlen + k > ocut_max && clip_caps & VNC_CLIP_PROVIDE)
+				break;
+			clip_tlen += k;
 		}
+		if (n > 0 && i == n)
+			return 0;
+		close(ocut_fd);
+		ocut_fd = -1;
+		if (!(clip_caps & VNC_CLIP_PROVIDE))
+			return ocut_done(fd);
+		memset(&ocut_z, 0, sizeof(ocut_z));
+		if (deflateInit(&ocut_z, Z_DEFAULT_COMPRESSION) != Z_OK)
+			return 0;
+		ocut_zon = 1;
+		ocut_pos = 0;
+		clip_outlen = 0;
+		return 0;
 	}
-	if (uprect.enc == htonl(VNC_ENC_RRE)) {
-		char pixel[8];
-		u32 n;
-		vread(fd, &n, 4);
-		vread(fd, pixel, bpp);
-		fillrect(pixel, x, y, w, h);
-		for (i = 0; i < ntohl(n); i++) {
-			u16 pos[4];
-			vread(fd, pixel, bpp);
-			vread(fd, pos, 8);
-			fillrect(pixel, x + ntohs(pos[0]), y + ntohs(pos[1]),
-				ntohs(pos[2]), ntohs(pos[3]));
-		}
-	}
-	if (uprect.enc == htonl(VNC_ENC_ZLIB)) {
-		int zlen;
-		char *zdat;
-		vread(fd, &zlen, 4);
-		zdat = malloc(ntohl(zlen));
-		vread(fd, zdat, ntohl(zlen));
-		z_push(zdat, ntohl(zlen));
-		free(zdat);
-		for (i = 0; i < h; i++)
-			z_read(RFB(x, y + i), w * bpp);
-	}
-	if (uprect.enc == htonl(VNC_ENC_ZRLE)) {
-		int zlen;
-		char *zdat;
-		vread(fd, &zlen, 4);
-		zdat = malloc(ntohl(zlen));
-		vread(fd, zdat, ntohl(zlen));
-		z_push(zdat, ntohl(zlen));
-		free(zdat);
-		if (readzrle(x, y, w, h))
-			return -1;
+	/* the text is preceded by its length and followed by a nul */
+	if (!scratch(&msg_buf, 4 + CUTCHUNK * 2 + 1)) {
+		ocut_stop();
+		return 0;
 	}
-	if (!nodraw)
-		drawfb(x, y, w, h);
-	return 0;
+	text = msg_buf.buf;
+	if (!ocut_pos) {
+		*(u32 *) text = htonl(clip_tlen);
+		n = 4;
+	}
+	for (i = ocut_pos; i < clip_len && i < ocut_pos + CUTCHUNK; i++) {
+		if (clip_buf.buf[i] == '\n' && (!i || clip_buf.buf[i - 1] != '\r'))
+			text[n++] = '\r';
+		text[n++] = clip_buf.buf[i];
+	}
+	ocut_pos = i;
+	if (ocut_pos == clip_len)
+		text[n++] = '\0';
+	ocut_z.next_in = (void *) text;
+	ocut_z.avail_in = n;
+	do {
+		if (!scratch(&clip_out, clip_outlen + deflateBound(&ocut_z, n))) {
+			ocut_stop();
+			return 0;
+		}
+		ocut_z.next_out = (void *) clip_out.buf + clip_outlen;
+		ocut_z.avail_out = clip_out.size - clip_outlen;
+		ret = deflate(&ocut_z, ocut_pos == clip_len ? Z_FINISH : Z_NO_FLUSH);
+		clip_outlen = (char *) ocut_z.next_out - clip_out.buf;
+	} while (ret == Z_OK && (ocut_z.avail_in || ocut_pos == clip_len));
+	if (ocut_pos < clip_len && ret == Z_OK)
+		return 0;
+	ocut_stop();
+	if (ret != Z_STREAM_END)
+		return 0;
+	clip_ready = 1;
+	return ocut_done(fd);
 }
 
-static int icut_copy(char *buf, int len)
+static void vnc_updbeg(void)
 {
-	int fd = icut != NULL ? open(icut, O_WRONLY | O_TRUNC | O_CREAT, 0600) : -1;
-	if (fd >= 0) {
-		write(fd, buf, len);
-		close(fd);
-		return 0;
-	}
-	return 1;
+	upd_beg = now();
+	upd_busy = evt_beg - upd_beg;
 }
 
-static int ocut_copy(int fd)
+static void vnc_updend(void)
 {
-	char buf[4096];
-	int cfd = ocut != NULL ? open(ocut, O_RDONLY) : -1;
-	if (cfd >= 0) {
-		struct vnc_cuttext ct = {VNC_CLIENTCUTTEXT};
-		int len = read(cfd, buf, sizeof(buf));
-		close(cfd);
-		ct.len = htonl(len);
-		vwrite(fd, &ct, sizeof(ct));
-		vwrite(fd, buf, len);
-		return 0;
+	long cur = now();
+	/* the time not spent on decoding or drawing was spent waiting */
+	upd_dec = upd_busy + cur - evt_beg;
+	vnc_wait += MAX(0, cur - upd_beg - upd_dec);
+	if (req_w > 0)
+		tile_mark(req_x, req_y, req_w, req_h, 0, TILE_STALE);
+	req_w = 0;
+	upd_done++;
+	if (shm) {
+		__sync_synchronize();
+		shm->seq++;
 	}
-	return 1;
 }
 
-static int vnc_event(int fd)
+/* parse a message or a part of it; return nonzero if it made progress */
+static int vnc_parse(int fd)
 {
-	char msg[1 << 12];
-	char *buf;
-	struct vnc_update *fbup = (void *) msg;
-	struct vnc_cuttext *cuttext = (void *) msg;
-	struct vnc_setcolormapentries *colormap = (void *) msg;
-	int i;
-	int n;
-
-	if (vread(fd, msg, 1) < 0)
-		return -1;
+	struct vnc_update fbup;
+	struct vnc_cuttext cuttext;
+	struct vnc_setcolormapentries colormap;
+	char *msg;
+	long n;
+	int ret;
+	if (cut_skip > 0) {
+		if (!iget(1))
+			return 0;
+		n = MIN(ilen - ipos, cut_skip);
+		iskip(n);
+		cut_skip -= n;
+		return 1;
+	}
+	if (upd_rects > 0) {
+		if ((ret = readrect(fd)) > 0 && --upd_rects == 0)
+			vnc_updend();
+		return ret;
+	}
+	if (!(msg = iget(1)))
+		return 0;
 	switch (msg[0]) {
 	case VNC_UPDATE:
-		vread(fd, msg + 1, sizeof(*fbup) - 1);
-		n = ntohs(fbup->n);
-		for (i = 0; i < n; i++)
-			if (readrect(fd))
-				return -1;
-		break;
+		if (!(msg = iget(sizeof(fbup))))
+			return 0;
+		memcpy(&fbup, msg, sizeof(fbup));
+		iskip(sizeof(fbup));
+		upd_rects = ntohs(fbup.n);
+		vnc_updbeg();
+		if (!upd_rects)
+			vnc_updend();
+		return 1;
 	case VNC_BELL:
-		break;
+		iskip(1);
+		return 1;
 	case VNC_SERVERCUTTEXT:
-		vread(fd, msg + 1, sizeof(*cuttext) - 1);
-		if ((buf = malloc(ntohl(cuttext->len))) == NULL) {
-			fprintf(stderr, "fbvnc: failed to allocate cuttext buffer\n");
-			return -1;
+		if (!(msg = iget(sizeof(cuttext))))
+			return 0;
+		memcpy(&cuttext, msg, sizeof(cuttext));
+		/* negative lengths mark extended clipboard messages */
+		n = (int) ntohl(cuttext.len);
+		/* texts longer than CUTMAX are discarded without buffering */
+		if ((n < 0 ? -n : n) > CUTMAX) {
+			iskip(sizeof(cuttext));
+			cut_skip = n < 0 ? -n : n;
+			return 1;
 		}
-		vread(fd, buf, ntohl(cuttext->len));
-		icut_copy(buf, ntohl(cuttext->len));
-		free(buf);
-		break;
+		if (!(msg = iget(sizeof(cuttext) + (n < 0 ? -n : n))))
+			return 0;
+		iskip(sizeof(cuttext) + (n < 0 ? -n : n));
+		if (n < 0)
+			return clip_event(fd, msg + sizeof(cuttext), -n) ? -1 : 1;
+		icut_copy(msg + sizeof(cuttext), n);
+		return 1;
 	case VNC_SETCOLORMAPENTRIES:
-		vread(fd, msg + 1, sizeof(*colormap) - 1);
-		if ((buf = malloc(ntohl(cuttext->len) * 3 * 2)) == NULL) {
-			fprintf(stderr, "fbvnc: failed to allocate colormap buffer\n");
-			return -1;
-		}
-		vread(fd, buf, ntohs(colormap->n) * 3 * 2);
-		free(buf);
-		break;
-	default:
-		fprintf(stderr, "fbvnc: unknown vnc msg %d\n", msg[0]);
-		return -1;
+		if (!(msg = iget(sizeof(colormap))))
+			return 0;
+		memcpy(&colormap, msg, sizeof(colormap));
+		n = sizeof(colormap) + ntohs(colormap.n) * 3 * 2;
+		if (!(msg = iget(n)))
+			return 0;
+		cmap_set(ntohs(colormap.first), ntohs(colormap.n), (u8 *) msg + sizeof(colormap));
+		iskip(n);
+		return 1;
 	}
-	return 0;
+	fprintf(stderr, "fbvnc: unknown vnc msg %d\n", msg[0]);
+	return -1;
+}
+
+/* more data has arrived than has been parsed */
+static int vnc_behind(int fd)
+{
+	int n = 0;
+	return ioctl(fd, FIONREAD, &n) == 0 && n > 0;
+}
+
+/* draw dirty tiles, unless behind the server and the screen was drawn recently */
+static void vnc_draw(int fd)
+{
+	long beg = now();
+	if (vnc_behind(fd) && beg - frm_last < FRMSKIP) {
+		if (!frm_skip)
+			frm_skip = beg;
+		frm_drop += upd_done;
+		return;
+	}
+	drawdirty();
+	frm_last = now();
+	frm_blit = frm_last - beg;
+	if (frm_skip)
+		frm_behind += frm_last - frm_skip;
+	frm_skip = 0;
+}
+
+/* handle the data received from the server; return the number of completed updates */
+static int vnc_event(int fd)
+{
+	int ret;
+	evt_beg = now();
+	upd_done = 0;
+	if (vnc_recv(fd))
+		return -1;
+	while ((ret = vnc_parse(fd)) > 0)
+		;
+	if (ret < 0)
+		return -1;
+	if (!nodraw && !sess_bg)
+		vnc_draw(fd);
+	if (upd_rects > 0)
+		upd_busy += now() - evt_beg;
+	/* if decoding and drawing are slow, leave as much time for the rest */
+	if (upd_done)
+		frm_next = upd_dec + frm_blit > FRMSLOW ? now() + upd_dec + frm_blit : 0;
+	return upd_done;
 }
 
 static int press(int fd, int key, int down)
@@ -564,8 +2431,25 @@ static int rat_event(int fd, int ratfd)
 	/* ignore mouse movements when nodraw */
 	if (nodraw)
 		return 0;
-	mc += ie[1];
-	mr -= ie[2];
+	/* map pointer movements to server coordinates */
+	switch (rotate) {
+	case 0:
+		mc += ie[1];
+		mr -= ie[2];
+		break;
+	case 1:
+		mc -= ie[2];
+		mr -= ie[1];
+		break;
+	case 2:
+		mc -= ie[1];
+		mr += ie[2];
+		break;
+	case 3:
+		mc += ie[2];
+		mr += ie[1];
+		break;
+	}
 
 	if (mc < oc)
 		oc = MAX(0, oc - cols / SCRSCRL);
@@ -603,7 +2487,11 @@ static int rat_event(int fd, int ratfd)
 
 static void showmsg(void)
 {
-	printf("\x1b[HFBVNC \t\t nr=%-8ld\tnw=%-8ld\r", vnc_nr, vnc_nw);
+	struct encstat *es = enc_find(enc_cur);
+	printf("\x1b[HFBVNC \t\t nr=%-8ld\tnw=%-8ld\tenc=%s/%d%s\talloc=%ld"
+		"\tdrop=%ld\tbehind=%ldms\r",
+		vnc_nr, vnc_nw, es ? es->name : "?", enc_lev, enc_auto ? "*" : "",
+		vnc_nalloc, frm_drop, frm_behind / 1000);
 	fflush(stdout);
 }
 
@@ -681,6 +2569,10 @@ static int kbd_event(int fd, int kbdfd)
 				k = key[++i];
 				if (k == 0x03)	/* esc-^C: quit */
 					return -1;
+				if (sess_n > 1 && k >= '1' && k < '1' + sess_n) {
+					sess_req = k - '1';	/* esc-digit: switch sessions */
+					continue;
+				}
 			}
 			break;
 		case 0x0d:
@@ -732,44 +2624,176 @@ static void term_cleanup(struct termios *ti)
 	fflush(stdout);
 }
 
-static void mainloop(int vnc_fd, int kbd_fd, int rat_fd)
+static void sess_save(struct sess *s)
+{
+#define X(v)	memcpy(&s->v, &v, sizeof(v));
+	SESS_VARS
+#undef X
+}
+
+/* z_str is only used in place, so its internal state still refers to it */
+static void sess_load(struct sess *s)
+{
+#define X(v)	memcpy(&v, &s->v, sizeof(v));
+	SESS_VARS
+#undef X
+}
+
+/* show session n; its rfb is up to date, so a single blit is enough */
+static void sess_switch(int n)
+{
+	sess_save(&sess[sess_cur]);
+	sess_load(&sess[n]);
+	sess_cur = n;
+	frm_next = 0;
+	dmg_n = 0;
+	ocut_stop();		/* the text was meant for the other server */
+	if (cmap_mode == CMAP_FB)
+		cmap_load();
+	if (!nodraw) {
+		drawclear();
+		nodraw_ref = 1;
+	}
+}
+
+/* handle the events of session n and request updates; resume is set when drawing is enabled */
+static int sess_event(int n, int revents, int resume)
+{
+	int fd = sess[n].fd;
+	int ret = 0;
+	int upd;
+	if (n != sess_cur) {
+		sess_save(&sess[sess_cur]);
+		sess_load(&sess[n]);
+		sess_bg = 1;
+	}
+	if (revents & POLLOUT && vflush(fd))
+		ret = -1;
+	if (!ret && revents & POLLIN) {
+		if ((upd = vnc_event(fd)) < 0 || (upd && enc_adapt(fd)))
+			ret = -1;
+		if (upd > 0)
+			req_pending = 0;
+		/* background sessions are updated at a slower rate */
+		if (upd > 0 && (sess_bg || nodraw))
+			frm_next = MAX(frm_next, now() + (nodraw ? hid_period : BGPERIOD));
+	}
+	if (resume)
+		frm_next = 0;
+	if (!ret && resume && !hid_period)
+		ret = vnc_resume(fd);
+	if (!ret && !req_pending && now() >= frm_next && (!nodraw || hid_period)) {
+		req_pending = 1;
+		ret = vnc_refresh(fd, 1);
+	}
+	if (n != sess_cur) {
+		sess_save(&sess[n]);
+		sess_load(&sess[sess_cur]);
+		sess_bg = 0;
+	}
+	return ret;
+}
+
+/* the earlier of two poll timeouts; negative means none */
+static int wake_min(int a, int b)
+{
+	return a < 0 ? b : (b < 0 ? a : MIN(a, b));
+}
+
+static void mainloop(int kbd_fd, int rat_fd)
 {
-	struct pollfd ufds[3];
-	int pending = 0;
-	int err;
+	struct pollfd ufds[2 + SESSMAX];
+	sigset_t sigs, sigs_old;
+	int hidden = 0, resume;
+	int err, i;
+	/* terminal switching signals are delivered only while waiting */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &sigs, &sigs_old);
 	ufds[0].fd = kbd_fd;
 	ufds[0].events = POLLIN;
-	ufds[1].fd = vnc_fd;
+	ufds[1].fd = rat_fd;
 	ufds[1].events = POLLIN;
-	ufds[2].fd = rat_fd;
-	ufds[2].events = POLLIN;
-	rat_event(vnc_fd, -1);
-	if (vnc_refresh(vnc_fd, 0))
-		return;
+	rat_event(sess[sess_cur].fd, -1);
+	for (i = 0; i < sess_n; i++) {
+		ufds[2 + i].fd = sess[i].fd;
+		if (sess_event(i, 0, 0))
+			return;
+	}
 	while (1) {
-		err = poll(ufds, 3, 500);
+		struct timespec ts;
+		int timeout = -1;
+		long beg;
+		sess_save(&sess[sess_cur]);
+		for (i = 0; i < sess_n; i++) {
+			if (!sess[i].req_pending && sess[i].frm_next && (!nodraw || hid_period))
+				timeout = wake_min(timeout, MAX(0, (sess[i].frm_next - now()) / 1000));
+			ufds[2 + i].events = POLLIN | (sess[i].wq_len ? POLLOUT : 0);
+		}
+		if (dmg_n && !nodraw)
+			timeout = wake_min(timeout, DMGTICK / 1000);
+		if (icut_fd >= 0 || ocut_fd >= 0 || ocut_zon)
+			timeout = 0;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000;
+		beg = TRACE_NOW();
+		err = ppoll(ufds, 2 + sess_n, timeout < 0 ? NULL : &ts, &sigs_old);
+		TRACE("poll", beg);
 		if (err == -1 && errno != EINTR)
 			break;
-		if (!err)
-			continue;
-		if (ufds[0].revents & POLLIN)
-			if (kbd_event(vnc_fd, kbd_fd) == -1)
+		if (icut_fd >= 0)
+			icut_write();
+		if (ocut_fd >= 0 || ocut_zon)
+			ocut_step(sess[sess_cur].fd);
+		if (err < 0)		/* interrupted by a signal */
+			for (i = 0; i < 2 + sess_n; i++)
+				ufds[i].revents = 0;
+		if (ufds[0].revents & (POLLHUP | POLLERR) && !(ufds[0].revents & POLLIN))
+			break;
+		if (ufds[0].revents & POLLIN) {
+			beg = TRACE_NOW();
+			if (kbd_event(sess[sess_cur].fd, kbd_fd) == -1)
 				break;
+			if (sess_req >= 0 && sess_req != sess_cur)
+				sess_switch(sess_req);
+			sess_req = -1;
+			TRACE("keyboard", beg);
+		}
 		if (ufds[1].revents & POLLIN) {
-			if (vnc_event(vnc_fd) == -1)
+			beg = TRACE_NOW();
+			if (rat_event(sess[sess_cur].fd, rat_fd) == -1)
 				break;
-			pending = 0;
+			TRACE("mouse", beg);
 		}
-		if (ufds[2].revents & POLLIN)
-			if (rat_event(vnc_fd, rat_fd) == -1)
+		/* paused or throttled sessions are refreshed when drawing is enabled */
+		resume = hidden && !nodraw;
+		hidden = nodraw;
+		/* the visible session is served first */
+		if (sess_event(sess_cur, ufds[2 + sess_cur].revents, resume))
+			break;
+		/* background sessions are loaded only if they have something to do */
+		for (i = 0; i < sess_n; i++) {
+			struct sess *s = &sess[i];
+			if (i == sess_cur)
+				continue;
+			if (resume)
+				s->frm_next = MAX(s->frm_next, now() + BGPERIOD);
+			if (!ufds[2 + i].revents && (s->req_pending ||
+					s->frm_next > now() || (nodraw && !hid_period)))
+				continue;
+			if (sess_event(i, ufds[2 + i].revents, 0))
 				break;
+		}
+		if (i < sess_n)
+			break;
 		if (!nodraw && nodraw_ref) {
 			nodraw_ref = 0;
+			tile_mark(0, 0, srv_cols, srv_rows, 0, TILE_DIRTY);
 			drawfb(oc, or, cols, rows);
 		}
-		if (!pending++)
-			if (vnc_refresh(vnc_fd, 1))
-				break;
+		if (!nodraw && dmg_on)
+			dmg_draw();
 	}
 }
 
@@ -785,11 +2809,11 @@ static void signalreceived(int sig)
 int main(int argc, char * argv[])
 {
 	char buf[256];
-	char *port = VNC_PORT;
-	char *host = "127.0.0.1";
+	char *shm_name = NULL;
 	struct termios ti;
 	int vnc_fd, rat_fd;
 	int enc = -1;
+	int nthd = sysconf(_SC_NPROCESSORS_ONLN);
 	int i;
 	for (i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
 		switch (argv[i][1]) {
@@ -814,16 +2838,65 @@ int main(int argc, char * argv[])
 		case 'w':
 			lock_key[3] = (unsigned char) (argv[i][2] ? argv[i][2] : argv[++i][0]);
 			break;
+		case 'r':
+			rotate = (atoi(argv[i][2] ? argv[i] + 2 : argv[++i]) / 90) & 3;
+			break;
+#ifdef FBVNC_TRACE
+		case 'T':
+			trace_out = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+#endif
+		case 'u':
+			hid_period = atol(argv[i][2] ? argv[i] + 2 : argv[++i]) * 1000;
+			break;
+		case 'f':
+			dsk_fit = 1;
+			break;
+		case 'k':
+			snap_dir = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'm':
+			shm_name = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'p':
+			cmap_mode = CMAP_LUT;
+			break;
+		case 't':
+			nthd = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			break;
+		case 'd':
+			dmg_on = 1;
+			break;
+		case 'D':
+			dmg_out = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
 		default:
-			printf("Usage: %s [options] [host] [port]\n\n", argv[0]);
+			printf("Usage: %s [options] [host [port]]...\n\n", argv[0]);
 			printf("Options:\n");
 			printf("  -i path   incoming cut text file\n");
 			printf("  -o path   outgoing cut text file\n");
-			printf("  -e enc    RFB encoding (0: raw, 2: rre, 6: zlib, 16: zrle)\n");
+			printf("  -e enc    RFB encoding (0: raw, 2: rre, 6: zlib, 15: trle, 16: zrle)\n");
+#ifdef FBVNC_H264
+			printf("            or 50: open h.264\n");
+#endif
+			printf("            adapted to the link speed if not given\n");
 			printf("  -a key    alt lock key\n");
 			printf("  -c key    control lock key\n");
 			printf("  -s key    shift lock key\n");
 			printf("  -w key    super lock key\n");
+			printf("  -r deg    clockwise screen rotation (90, 180, 270)\n");
+			printf("  -u ms     update interval when drawing is disabled\n");
+			printf("            (SIGUSR1); updates are paused if not given\n");
+			printf("  -f        resize the server screen to the framebuffer\n");
+			printf("  -p        ask for 8-bit colour-mapped pixels\n");
+			printf("  -k dir    keep screen snapshots in dir, to show on startup\n");
+			printf("  -m path   share the screen contents in this file\n");
+			printf("  -t n      number of threads drawing large updates\n");
+			printf("  -d        outline updated regions\n");
+			printf("  -D path   save the bytes received per screen tile\n");
+#ifdef FBVNC_TRACE
+			printf("  -T path   save a trace of the last events on exit\n");
+#endif
 			return 0;
 		}
 	}
@@ -834,46 +2907,97 @@ int main(int argc, char * argv[])
 		if (tcsetpgrp(0, getppid()) == 0)
 			setpgid(0, getppid());
 	}
-	/* connect to the server */
-	if (argv[i] && strcmp("-", argv[i]))
-		host = argv[i];
-	if (argv[i] && argv[i + 1])
-		port = argv[i + 1];
-	if ((vnc_fd = vnc_connect(host, port)) < 0) {
-		fprintf(stderr, "fbvnc: could not connect!\n");
-		return 1;
-	}
 	/* set up the framebuffer */
 	if (fb_init(getenv("FBDEV"))) {
 		fprintf(stderr, "fbvnc: vnc init failed!\n");
 		return 1;
 	}
-	if (vnc_init(vnc_fd, enc) < 0) {
-		fprintf(stderr, "fbvnc: vnc init failed!\n");
-		return 1;
-	}
-	if (z_init() != 0) {
-		fprintf(stderr, "fbvnc: failed to initialise a zlib stream\n");
-		return 1;
-	}
-	if ((rfb = malloc(srv_rows * srv_cols * bpp)) == NULL) {
-		fprintf(stderr, "fbvnc: failed to allocate rfb\n");
+	fbpp = FBM_BPP(fb_mode());
+	blit_init(nthd);
+	if (cmap_mode)
+		cmap_init();
+	/* decoded h.264 frames are not colour-mapped */
+	if (cmap_mode && enc == VNC_ENC_H264)
+		enc = -1;
+	/* connect to the servers; each host may be followed by its port */
+	sess_save(&sess_new);
+	do {
+		char *host = "127.0.0.1";
+		char *port = VNC_PORT;
+		if (argv[i] && strcmp("-", argv[i]))
+			host = argv[i];
+		if (argv[i] && argv[i + 1] && !argv[i + 1][strspn(argv[i + 1], "0123456789")])
+			port = argv[++i];
+		if (argv[i])
+			i++;
+		sess_load(&sess_new);
+		/* later sessions share their rfb in shm_name.2, shm_name.3, ... */
+		if (shm_name && sess_n) {
+			shm_path = malloc(strlen(shm_name) + 8);
+			sprintf(shm_path, "%s.%d", shm_name, sess_n + 1);
+		} else {
+			shm_path = shm_name;
+		}
+		if ((vnc_fd = vnc_connect(host, port)) < 0) {
+			fprintf(stderr, "fbvnc: could not connect!\n");
+			return 1;
+		}
+		if (vnc_init(vnc_fd, enc) < 0) {
+			fprintf(stderr, "fbvnc: vnc init failed!\n");
+			return 1;
+		}
+		if (z_init() != 0) {
+			fprintf(stderr, "fbvnc: failed to initialise a zlib stream\n");
+			return 1;
+		}
+		if (rfb_init()) {
+			fprintf(stderr, "fbvnc: failed to allocate rfb\n");
+			return 1;
+		}
+		/* the snapshot is shown until fresh rects replace it */
+		if (snap_dir) {
+			snap_path = snap_name(host, port);
+			if (snap_load() && !sess_n)
+				nodraw_ref = 1;
+		}
+		sess[sess_n].fd = vnc_fd;
+		sess_save(&sess[sess_n++]);
+	} while (argv[i] && sess_n < SESSMAX);
+	if (argv[i]) {
+		fprintf(stderr, "fbvnc: at most %d sessions are supported\n", SESSMAX);
 		return 1;
 	}
+	sess_load(&sess[0]);
 	term_setup(&ti);
+	if (nodraw_ref) {
+		nodraw_ref = 0;
+		drawfb(oc, or, cols, rows);
+	}
 
 	/* entering intellimouse for using mouse wheel */
 	rat_fd = open("/dev/input/mice", O_RDWR);
 	write(rat_fd, "\xf3\xc8\xf3\x64\xf3\x50", 6);
 	read(rat_fd, buf, 1);
 
-	mainloop(vnc_fd, 0, rat_fd);
+	mainloop(0, rat_fd);
 
 	term_cleanup(&ti);
-	z_free();
+	if (dmg_out)
+		dmg_save(dmg_out);
+#ifdef FBVNC_TRACE
+	if (trace_out)
+		trace_save(trace_out);
+#endif
+	sess_save(&sess[sess_cur]);
+	for (i = 0; i < sess_n; i++) {
+		sess_load(&sess[i]);
+		if (snap_path)
+			snap_save();
+		z_free();
+		rfb_free();
+		close(sess[i].fd);
+	}
 	fb_free();
-	free(rfb);
-	close(vnc_fd);
 	close(rat_fd);
 	return 0;
 }
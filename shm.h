@@ -0,0 +1,32 @@
+/*
+ * The layout of fbvnc's shared framebuffer (the -m option)
+ *
+ * The file starts with struct shm_head; the screen contents follow at
+ * offset size, in rows of cols pixels of bpp bytes.  After each update,
+ * the rects it changed are appended to the log and seq is incremented.
+ * When the server screen is resized, a new file is written and renamed
+ * over the path; the old file keeps its size but is no longer updated.
+ * Readers should map the path again when its inode changes.  In the
+ * colour-mapped mode (-p), pixels are indices into cmap and the colour
+ * bits are zero.
+ */
+#define SHM_MAGIC	0x53425646	/* "FVBS" */
+#define SHM_LOG		256		/* dirty rects kept in the log */
+
+struct shm_rect {
+	unsigned int seq;		/* the update the rect belongs to */
+	unsigned short x, y, w, h;
+};
+
+struct shm_head {
+	unsigned int magic;
+	unsigned int size;		/* header size; pixels start here */
+	unsigned int cols, rows;	/* screen dimensions */
+	unsigned int bpp;		/* bytes per pixel */
+	unsigned int rbits, gbits, bbits;	/* bits per colour */
+	unsigned int rshl, gshl, bshl;	/* colour shifts */
+	unsigned int seq;		/* number of completed updates */
+	unsigned int nlog;		/* rects logged; rect i is in log[i % SHM_LOG] */
+	unsigned int cmap[256];		/* colour map entries as 0xrrggbb */
+	struct shm_rect log[SHM_LOG];
+};
@@ -18,6 +18,7 @@
 #define VNC_KEYEVENT		4
 #define VNC_POINTEREVENT	5
 #define VNC_CLIENTCUTTEXT	6
+#define VNC_SETDESKTOPSIZE	251
 
 #define VNC_ENC_RAW		0
 #define VNC_ENC_COPYRECT	1
@@ -27,7 +28,25 @@
 #define VNC_ENC_ZLIB		6
 #define VNC_ENC_TIGHT		7
 #define VNC_ENC_ZLIBHEX		8
+#define VNC_ENC_TRLE		15
 #define VNC_ENC_ZRLE		16
+#define VNC_ENC_H264		50		/* Open H.264 */
+#define VNC_ENC_COMPRESS(l)	(-256 + (l))	/* CompressLevel pseudo-encoding */
+#define VNC_ENC_EXTCLIP		0xc0a1e5ce	/* Extended Clipboard pseudo-encoding */
+#define VNC_ENC_DESKTOPSIZE	-223		/* DesktopSize pseudo-encoding */
+#define VNC_ENC_EXTDESKTOPSIZE	-308		/* ExtendedDesktopSize pseudo-encoding */
+
+/* extended clipboard flags */
+#define VNC_CLIP_TEXT		0x00000001
+#define VNC_CLIP_CAPS		0x01000000
+#define VNC_CLIP_REQUEST	0x02000000
+#define VNC_CLIP_PEEK		0x04000000
+#define VNC_CLIP_NOTIFY		0x08000000
+#define VNC_CLIP_PROVIDE	0x10000000
+
+/* open h.264 flags */
+#define VNC_H264_RESET		0x00000001	/* reset the rect's decoder */
+#define VNC_H264_RESETALL	0x00000002	/* reset all decoders */
 
 #define VNC_BUTTON1_MASK	0x01
 #define VNC_BUTTON2_MASK	0x02
@@ -119,6 +138,25 @@ struct vnc_updaterequest {
 	u16 h;
 };
 
+struct vnc_screen {
+	u32 id;
+	u16 x;
+	u16 y;
+	u16 w;
+	u16 h;
+	u32 flags;
+};
+
+struct vnc_setdesktopsize {
+	u8 type;
+	u8 pad1;
+	u16 w;
+	u16 h;
+	u8 n;
+	u8 pad2;
+	/* struct vnc_screen screens[n]; */
+};
+
 struct vnc_keyevent {
 	u8 type;
 	u8 down;